@@ -30,12 +30,29 @@ struct cix_client_execution {
 	unsigned int price;
 };
 
+struct cix_client_cancel_ack {
+	uint64_t order_id;
+	unsigned int quantity;
+	enum cix_client_ack_status status;
+};
+
+struct cix_client_replace_ack {
+	uint64_t order_id;
+	unsigned int remaining;
+	unsigned int price;
+	enum cix_client_ack_status status;
+};
+
 typedef void cix_client_ack_cb_t(struct cix_client_ack *, void *);
 typedef void cix_client_exec_cb_t(struct cix_client_execution *, void *);
+typedef void cix_client_cancel_cb_t(struct cix_client_cancel_ack *, void *);
+typedef void cix_client_replace_cb_t(struct cix_client_replace_ack *, void *);
 
 struct cix_client_callbacks {
 	cix_client_ack_cb_t *ack;
 	cix_client_exec_cb_t *exec;
+	cix_client_cancel_cb_t *cancel;
+	cix_client_replace_cb_t *replace;
 };
 
 struct cix_client {
@@ -75,5 +92,9 @@ struct cix_message_order;
 bool cix_client_send_order(struct cix_client *,
     const struct cix_message_order *);
 
+bool cix_client_send_cancel(struct cix_client *, uint64_t);
+bool cix_client_send_replace(struct cix_client *, uint64_t, unsigned int,
+    unsigned int);
+
 
 #endif /* _CIX_CLIENT_SESSION_H */
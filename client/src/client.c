@@ -66,6 +66,65 @@ cix_client_receive_exec(const struct cix_client *client,
 	return;
 }
 
+static void
+cix_client_receive_cancel(const struct cix_client *client,
+    const struct cix_message_cancel_ack *message)
+{
+	struct cix_client_cancel_ack ack;
+
+	if (client->callbacks.cancel == NULL) {
+		return;
+	}
+
+	ack.order_id = message->internal_id;
+	ack.quantity = message->quantity;
+	switch (message->status) {
+	case CIX_ORDER_STATUS_OK:
+		ack.status = CIX_CLIENT_ACK_STATUS_OK;
+		break;
+	case CIX_ORDER_STATUS_ERROR:
+		ack.status = CIX_CLIENT_ACK_STATUS_ERROR;
+		break;
+	default:
+		fprintf(stderr, "Invalid cancel status %u\n",
+		    (unsigned)message->status);
+		return;
+	}
+
+	client->callbacks.cancel(&ack, client->closure);
+	return;
+}
+
+static void
+cix_client_receive_replace(const struct cix_client *client,
+    const struct cix_message_replace_ack *message)
+{
+	struct cix_client_replace_ack ack;
+
+	if (client->callbacks.replace == NULL) {
+		return;
+	}
+
+	ack.order_id = message->internal_id;
+	ack.remaining = message->remaining;
+	ack.price = message->price;
+	switch (message->status) {
+	case CIX_ORDER_STATUS_OK:
+		ack.status = CIX_CLIENT_ACK_STATUS_OK;
+		break;
+	case CIX_ORDER_STATUS_ERROR:
+		ack.status = CIX_CLIENT_ACK_STATUS_ERROR;
+		break;
+	default:
+		fprintf(stderr, "Invalid replace status %u\n",
+		    (unsigned)message->status);
+		return;
+	}
+
+	client->callbacks.replace(&ack, client->closure);
+	return;
+}
+
 static void
 cix_client_receive(struct cix_client *client)
 {
@@ -100,6 +159,14 @@ cix_client_receive(struct cix_client *client)
 			cix_client_receive_exec(client,
 			    &message->payload.execution);
 			break;
+		case CIX_MESSAGE_CANCEL_ACK:
+			cix_client_receive_cancel(client,
+			    &message->payload.cancel_ack);
+			break;
+		case CIX_MESSAGE_REPLACE_ACK:
+			cix_client_receive_replace(client,
+			    &message->payload.replace_ack);
+			break;
 		default:
 			fprintf(stderr, "Unrecognized message type %u\n",
 			    (unsigned)message->type);
@@ -237,6 +304,45 @@ cix_client_send_order(struct cix_client *client,
 	return cix_client_send(client);
 }
 
+bool
+cix_client_send_cancel(struct cix_client *client, uint64_t order_id)
+{
+	unsigned char buf[sizeof(struct cix_message_cancel) + 1];
+	struct cix_message_cancel cancel = { .internal_id = order_id };
+
+	buf[0] = CIX_MESSAGE_CANCEL;
+	memcpy(buf + 1, &cancel, sizeof cancel);
+
+	if (cix_buffer_append(&client->write_buf, buf, sizeof buf) == false) {
+		fprintf(stderr, "Failed to buffer write\n");
+		return false;
+	}
+
+	return cix_client_send(client);
+}
+
+bool
+cix_client_send_replace(struct cix_client *client, uint64_t order_id,
+    unsigned int quantity, unsigned int price)
+{
+	unsigned char buf[sizeof(struct cix_message_replace) + 1];
+	struct cix_message_replace replace = {
+		.internal_id = order_id,
+		.quantity = quantity,
+		.price = price
+	};
+
+	buf[0] = CIX_MESSAGE_REPLACE;
+	memcpy(buf + 1, &replace, sizeof replace);
+
+	if (cix_buffer_append(&client->write_buf, buf, sizeof buf) == false) {
+		fprintf(stderr, "Failed to buffer write\n");
+		return false;
+	}
+
+	return cix_client_send(client);
+}
+
 void
 cix_client_batch_start(struct cix_client *client)
 {
@@ -119,6 +119,7 @@ stress_thread_init_orders(struct stress_thread *thread)
 		    stress_config.min_quantity, stress_config.max_quantity);
 		order->side = (i & 1) ? CIX_TRADE_SIDE_BUY :
 		    CIX_TRADE_SIDE_SELL;
+		order->type = CIX_ORDER_TYPE_LIMIT;
 		u = stress_random_range(0, cix_vector_length(
 		    stress_config.symbols) - 1);
 		strcpy(order->symbol.symbol,
@@ -36,7 +36,8 @@ class Order(object):
         data += int_to_network(self.quantity)
         data += int_to_network(self.price)
         data.append(0 if self.side == 'B' else 1)
-        data += [0] * 16
+        data.append(0) # LIMIT
+        data += [0] * 15
         return ''.join(map(chr, data))
         
 
@@ -1,34 +1,219 @@
 #ifndef _CIX_BOOK_H
 #define _CIX_BOOK_H
 
+#include <ck_cc.h>
+#include <ck_sequence.h>
 #include <inttypes.h>
 
-#include "heap.h"
 #include "id_generator.h"
 #include "messages.h"
 
+/* XXX: Make this configurable per symbol */
+#define CIX_BOOK_DEFAULT_LADDER_SIZE	(1 << 12)
+
+/*
+ * Internal order IDs carry the market-wide number of the book that issued
+ * them in their top bits, so that a message that only names an order can
+ * be routed to the thread that owns its book.
+ */
+#define CIX_BOOK_ID_SHIFT	40
+#define CIX_BOOK_ID_INDEX(ID)	((ID) >> CIX_BOOK_ID_SHIFT)
+#define CIX_BOOK_MAX_INDEX	((1u << (64 - CIX_BOOK_ID_SHIFT)) - 1)
+
+struct cix_order;
+struct cix_order_index;
+struct cix_session_batch;
+struct cix_slab;
 struct cix_trade_log_manager;
+struct cix_vector;
+
+/*
+ * All resting orders at a single price, in time priority.
+ */
+struct cix_book_level {
+	struct cix_order *head;
+	struct cix_order *tail;
+	cix_price_t price;
+
+	/* Total shares remaining across all orders at this level */
+	uint64_t quantity;
+};
+
+/*
+ * One side of the book.  Prices inside the ladder window are stored in a
+ * flat array indexed by tick, with a two-level bitmap of non-empty levels
+ * so that the best price can be found with a handful of bit scans.
+ * Prices outside the window are kept in a sorted vector of levels with the
+ * best price at the end.
+ */
+struct cix_book_side {
+	struct cix_book_level *levels;
+	uint64_t *map;
+	uint64_t *summary;
+	struct cix_vector *sparse;
+};
+
+/*
+ * In the continuous phase every order is matched as it arrives.  In the
+ * auction phase orders only rest, so the book may be locked or crossed,
+ * until cix_book_uncross() executes them all at a single price.
+ */
+enum cix_book_phase {
+	CIX_BOOK_PHASE_CONTINUOUS = 0,
+	CIX_BOOK_PHASE_AUCTION
+};
+
+struct cix_book_config {
+	/*
+	 * Price of the lowest ladder level.  If 0, the ladder is centered
+	 * on the price of the first order received by the book.
+	 */
+	cix_price_t ladder_base;
+
+	/* Number of ticks in the ladder; must be a power of two >= 64 */
+	unsigned int ladder_size;
+};
+
+/*
+ * Resources shared by all books that are processed on the same market
+ * thread.  None of these are thread-safe.
+ */
+struct cix_book_context {
+	struct cix_trade_log_manager *trade_log;
+
+	/* Index of resting orders by internal ID */
+	struct cix_order_index *orders;
+
+	/*
+	 * Allocators for orders, which are split into a record that is read
+	 * while matching and one that is only read when an order executes.
+	 */
+	struct cix_slab *pool;
+	struct cix_slab *info_pool;
+
+	/* Sessions with reports waiting to be announced */
+	struct cix_session_batch *batch;
+};
+
+/*
+ * Best bid and offer.  Prices and sizes are 0 when that side of the book
+ * is empty.  The sequence number increases every time the BBO changes.
+ */
+struct cix_book_bbo {
+	uint64_t sequence;
+	cix_price_t bid;
+	cix_price_t offer;
+	uint64_t bid_size;
+	uint64_t offer_size;
+};
 
 struct cix_book {
 	uint32_t recv_counter;
-	struct cix_heap bid;
-	struct cix_heap offer;
+	struct cix_book_side bid;
+	struct cix_book_side offer;
 	cix_symbol_t symbol;
+	unsigned int index;
+
+	cix_price_t ladder_base;
+	unsigned int ladder_size;
+	enum cix_book_phase phase;
+
+	/*
+	 * Scratch space for two words per ladder price, used to find the
+	 * clearing price.  Allocated by the first uncross and then kept.
+	 */
+	uint64_t *auction_volume;
 
 	/* XXX: Have separate id blocks for order and trade IDs */
 	struct cix_id_block id_block;
 
-	struct cix_trade_log_manager *trade_log;
+	struct cix_book_context context;
+
+	/*
+	 * Top of book, published by the matching thread after every change
+	 * so that other threads can read it without going through the
+	 * market queue.  Kept on its own cache line so that readers do not
+	 * contend with matching.
+	 */
+	struct {
+		ck_sequence_t lock;
+		struct cix_book_bbo data;
+	} bbo CK_CC_CACHELINE;
 };
 
+/* Size of the objects that a book allocates from its order pools */
+extern const size_t cix_book_order_size;
+extern const size_t cix_book_order_info_size;
+
 struct cix_message_order;
+struct cix_message_replace;
 struct cix_session;
 
-bool cix_book_init(struct cix_book *, cix_symbol_t *,
-    struct cix_trade_log_manager *);
+bool cix_book_init(struct cix_book *, cix_symbol_t *, unsigned int,
+    const struct cix_book_config *, const struct cix_book_context *);
 void cix_book_destroy(struct cix_book *);
 
 bool cix_book_order(struct cix_book *, struct cix_message_order *,
     struct cix_session *);
 
+/*
+ * Stop matching incoming orders until the next call to cix_book_uncross().
+ */
+void cix_book_auction(struct cix_book *);
+
+/*
+ * Execute all crossed orders at the single price that maximizes executed
+ * volume and return the book to continuous matching.  Returns false, with
+ * the book still in the auction phase, if no memory is available to
+ * compute the clearing price.
+ */
+bool cix_book_uncross(struct cix_book *);
+
+/*
+ * Hand a book over to another market thread.  The thread that owns the book
+ * calls cix_book_detach, which takes every resting order out of its
+ * context and returns copies of them in a vector.  The new owner then
+ * passes that vector to cix_book_attach, which re-creates the orders in
+ * its own context in the same price-time priority and releases the
+ * vector.  The book must not be used in between.
+ */
+bool cix_book_detach(struct cix_book *, struct cix_vector **);
+void cix_book_attach(struct cix_book *, const struct cix_book_context *,
+    struct cix_vector *);
+
+/*
+ * Cancel every resting order and report each cancel to the order's
+ * session.  Returns false, leaving the book unchanged, if no memory is
+ * available.
+ */
+bool cix_book_clear(struct cix_book *);
+
+/*
+ * Read a consistent snapshot of the book's BBO.  This is safe to call from
+ * any thread and never blocks the matching thread.
+ */
+void cix_book_bbo(const struct cix_book *, struct cix_book_bbo *);
+
+/*
+ * Returns true if no orders are resting on either side of the book.  Only
+ * the thread that owns the book may call this.
+ */
+bool cix_book_empty(const struct cix_book *);
+
+/*
+ * Remove a resting order from whichever book in the given context's index
+ * holds it and report the result to the requesting session.  Only the
+ * session that entered an order may cancel it.
+ */
+bool cix_book_cancel(const struct cix_book_context *, cix_order_id_t,
+    struct cix_session *);
+
+/*
+ * Modify a resting order's price and/or size, with the same lookup and
+ * ownership rules as cix_book_cancel.  See struct cix_message_replace for
+ * the effect on queue priority.
+ */
+bool cix_book_replace(const struct cix_book_context *,
+    struct cix_message_replace *, struct cix_session *);
+
 #endif /* _CIX_BOOK_H */
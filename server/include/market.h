@@ -1,16 +1,177 @@
 #ifndef _CIX_MARKET_H
 #define _CIX_MARKET_H
 
+#include <inttypes.h>
 #include <stdbool.h>
 
+#include "messages.h"
+
+struct cix_book_bbo;
 struct cix_market;
+struct cix_message_cancel;
 struct cix_message_order;
+struct cix_message_replace;
 struct cix_session;
+struct cix_slab_stats;
 struct cix_vector;
 
-struct cix_market *cix_market_init(struct cix_vector *, unsigned int);
+/*
+ * Load on one symbol over the last rebalancing interval.
+ */
+struct cix_market_load {
+	/* Messages processed per second */
+	uint64_t messages;
+
+	/* Nanoseconds spent processing them per second */
+	uint64_t nsec;
+
+	/* Market thread that currently owns the symbol's book */
+	unsigned int thread;
+};
+
+/*
+ * How a market thread waits for requests when its queue is empty.
+ */
+enum cix_market_wait_strategy {
+	/* Sleep in an event loop until a producer signals the queue */
+	CIX_MARKET_WAIT_EVENT = 0,
+
+	/*
+	 * Poll the queue without ever sleeping.  Producers skip the wakeup
+	 * altogether.  This dedicates a core to the thread.
+	 */
+	CIX_MARKET_WAIT_SPIN,
+
+	/* Poll the queue for a while and then sleep until signalled */
+	CIX_MARKET_WAIT_PARK
+};
+
+struct cix_market_wait {
+	enum cix_market_wait_strategy strategy;
+
+	/* Number of empty polls before sleeping, for CIX_MARKET_WAIT_PARK */
+	unsigned int spin;
+};
+
+/*
+ * Outcome of submitting a message to the market.
+ */
+enum cix_market_status {
+	CIX_MARKET_OK = 0,
+
+	/*
+	 * A message was not queued because the market thread that owns
+	 * its book is backed up.  The caller should stop accepting new
+	 * messages and resubmit it later.  Once a thread's queue
+	 * passes its high-water mark, it reports itself busy until its
+	 * queue drains below the low-water mark.
+	 */
+	CIX_MARKET_BUSY,
+
+	CIX_MARKET_ERROR
+};
+
+struct cix_market_config {
+	unsigned int n_thread;
+
+	/*
+	 * Number of lanes into each market thread, normally one for each
+	 * session thread.  See cix_market_messages.
+	 */
+	unsigned int n_lane;
+
+	/*
+	 * CPU for each market thread, or NULL to let them all run anywhere.
+	 * Each thread's queue, order pools and books are allocated from its
+	 * CPU's NUMA node.
+	 */
+	const int *cpu;
+
+	/* CPU for trade log rotation, rebalancing and reclaiming books */
+	int background_cpu;
+
+	/*
+	 * Seconds after which a book with no resting orders that has not
+	 * received any messages is released.  0 keeps books forever.
+	 */
+	unsigned int book_idle_sec;
+};
+
+/*
+ * Books are initially assigned to threads by a hash of their symbol.  With
+ * more than one thread, the market periodically moves a book from its
+ * busiest thread to its idlest while it runs.  A symbol's book is only
+ * created when it receives its first order or control request.
+ */
+struct cix_market *cix_market_init(struct cix_vector *,
+    const struct cix_market_config *);
 bool cix_market_run(struct cix_market *);
-bool cix_market_order(struct cix_market *, struct cix_message_order *,
-    struct cix_session *);
+
+/*
+ * Choose how the given market thread waits for work.  Threads use
+ * CIX_MARKET_WAIT_EVENT unless this is called before cix_market_run.
+ */
+bool cix_market_thread_wait(struct cix_market *, unsigned int,
+    const struct cix_market_wait *);
+
+/*
+ * Queue orders, cancels and replaces received from a session, in order.
+ * Consecutive messages for books on the same market thread are queued
+ * together with a single wakeup.  Orders for unknown symbols are rejected
+ * here.  The number of messages consumed is stored in the last argument;
+ * on CIX_MARKET_BUSY the caller should resubmit the rest later.
+ *
+ * The second argument is the caller's lane.  Each lane below the
+ * configured count must only ever be used by one thread at a time, and
+ * messages sent through it are queued without contending with any other
+ * thread.  Higher lanes share a queue on each market thread.
+ */
+enum cix_market_status cix_market_messages(struct cix_market *, unsigned int,
+    const struct cix_message *, unsigned int, struct cix_session *,
+    unsigned int *);
+
+/*
+ * Switch a symbol's book to the auction phase, or back to continuous
+ * matching by executing everything that crosses at a single clearing
+ * price.  A NULL symbol applies to every book.  These are queued behind
+ * any messages already submitted for the affected books.
+ */
+bool cix_market_auction(struct cix_market *, const cix_symbol_t *);
+bool cix_market_uncross(struct cix_market *, const cix_symbol_t *);
+
+/*
+ * Report occupancy of the order pool and the order info pool belonging to
+ * the given market thread.  This is safe to call from any thread.
+ */
+bool cix_market_order_pool_stats(struct cix_market *, unsigned int,
+    struct cix_slab_stats *, struct cix_slab_stats *);
+
+/*
+ * Read the best bid and offer for a symbol without involving the market
+ * thread that owns its book.  Returns false if the symbol is unknown.
+ * This is safe to call from any thread.
+ */
+bool cix_market_bbo(struct cix_market *, const cix_symbol_t *,
+    struct cix_book_bbo *);
+
+/*
+ * Read the load on a symbol's book.  Rates are only computed when the
+ * market has more than one thread.  This is safe to call from any thread.
+ */
+bool cix_market_symbol_load(struct cix_market *, const cix_symbol_t *,
+    struct cix_market_load *);
+
+/*
+ * List a new symbol while the market is running, or relist a symbol that
+ * was delisted.  Sessions may send orders for it as soon as this returns.
+ */
+bool cix_market_symbol_add(struct cix_market *, const cix_symbol_t *);
+
+/*
+ * Delist a symbol.  New orders for it are rejected immediately, and the
+ * thread that owns its book cancels every resting order and releases the
+ * book.
+ */
+bool cix_market_symbol_retire(struct cix_market *, const cix_symbol_t *);
 
 #endif /* _CIX_MARKET_H */
@@ -0,0 +1,48 @@
+#ifndef _CIX_ORDER_INDEX_H
+#define _CIX_ORDER_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "messages.h"
+
+struct cix_order;
+
+/*
+ * Open-addressing hash table mapping internal order IDs to resting orders.
+ * Collisions are resolved with linear probing and removal uses backward
+ * shifting, so there are no tombstones and lookups never degrade as orders
+ * come and go.  Each market thread keeps its own index; it is not
+ * thread-safe.
+ */
+
+struct cix_order_index_entry {
+	cix_order_id_t id;
+
+	/* NULL if this entry is unused */
+	struct cix_order *order;
+};
+
+struct cix_order_index {
+	struct cix_order_index_entry *entries;
+	uint64_t mask;
+	size_t n_entries;
+};
+
+bool cix_order_index_init(struct cix_order_index *, size_t);
+void cix_order_index_destroy(struct cix_order_index *);
+
+bool cix_order_index_insert(struct cix_order_index *, cix_order_id_t,
+    struct cix_order *);
+struct cix_order *cix_order_index_find(const struct cix_order_index *,
+    cix_order_id_t);
+
+/*
+ * Remove the given order ID from the index and return its order, or NULL
+ * if the ID was not present.
+ */
+struct cix_order *cix_order_index_remove(struct cix_order_index *,
+    cix_order_id_t);
+
+#endif /* _CIX_ORDER_INDEX_H */
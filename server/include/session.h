@@ -8,18 +8,76 @@
 struct cix_market;
 struct cix_session;
 
+#define CIX_SESSION_BATCH_SIZE	(1 << 6)
+
+/*
+ * Set of sessions with reports that have been queued but not yet
+ * announced.  A thread that generates many reports at once (e.g. a market
+ * thread processing a batch of orders) can pass one of these to the report
+ * functions and then flush it, so that each session is woken at most once
+ * per batch instead of once per report.  Passing NULL instead wakes the
+ * session immediately.
+ */
+struct cix_session_batch {
+	struct cix_session *sessions[CIX_SESSION_BATCH_SIZE];
+	unsigned int count;
+};
+
+void cix_session_batch_init(struct cix_session_batch *);
+
+/*
+ * Wake every session that has received reports since the last flush.
+ */
+void cix_session_batch_flush(struct cix_session_batch *);
+
+struct cix_session_config {
+	unsigned int n_thread;
+
+	/*
+	 * CPU for each session thread, or NULL to let them all run anywhere.
+	 * Sessions are allocated on the node of the thread that serves them.
+	 */
+	const int *cpu;
+
+	/* CPU for the thread that accepts new connections */
+	int accept_cpu;
+};
+
 /*
  * Initializes the given number of sessions and starts listening
  * for new connections.
  *
- * XXX: Provide configuration for port numbers, thread count, etc.
+ * XXX: Provide configuration for port numbers.
  */
-void cix_session_listen(struct cix_market *, unsigned int);
+void cix_session_listen(struct cix_market *,
+    const struct cix_session_config *);
 
 bool cix_session_ack_report(struct cix_session *, const char *, cix_order_id_t,
-    enum cix_order_status);
+    enum cix_order_status, struct cix_session_batch *);
 bool cix_session_execution_report(struct cix_session *,
-    cix_order_id_t, cix_price_t, cix_quantity_t);
+    cix_order_id_t, cix_price_t, cix_quantity_t, struct cix_session_batch *);
+bool cix_session_cancel_report(struct cix_session *, cix_order_id_t,
+    cix_quantity_t, enum cix_order_status, struct cix_session_batch *);
+bool cix_session_replace_report(struct cix_session *, cix_order_id_t,
+    cix_quantity_t, cix_price_t, enum cix_order_status,
+    struct cix_session_batch *);
+
+/*
+ * Reject an order with an error ack without going through the session's
+ * report queue.  Reports that were already queued are sent first.  Only
+ * the thread that runs the session may call this.
+ */
+bool cix_session_reject(struct cix_session *, const char *);
+
+/*
+ * Take or drop references to a session.  Besides its connection, every
+ * message that the market has not processed yet, resting order and batch
+ * that will wake the session holds one.  A session that disconnects stays
+ * allocated until the last of these is dropped, and reports for it are
+ * discarded.
+ */
+void cix_session_hold(struct cix_session *, unsigned int);
+void cix_session_release(struct cix_session *, unsigned int);
 
 cix_user_id_t cix_session_user_id(const struct cix_session *);
 
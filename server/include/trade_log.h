@@ -34,6 +34,9 @@ struct cix_trade_log_file {
 
 struct cix_trade_log_config {
 	char *path;
+
+	/* CPU for the file rotation thread, or CIX_THREAD_CPU_ANY */
+	int cpu;
 };
 
 struct cix_trade_log_manager {
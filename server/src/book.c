@@ -1,3 +1,4 @@
+#include <ck_sequence.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
@@ -8,20 +9,46 @@
 #include "book.h"
 #include "id_generator.h"
 #include "messages.h"
+#include "order_index.h"
 #include "session.h"
+#include "slab.h"
 #include "trade_data.h"
 #include "trade_log.h"
+#include "vector.h"
 
-#define CIX_BOOK_DEFAULT_HEAP_SIZE	(1 << 8)
+#define CIX_BOOK_SPARSE_SIZE		(1 << 3)
 
-#define CIX_BOOK_BUY_SCORE(O) (((((uint64_t)(O)->data.price)) << 32) | \
-	((~((O)->recv_time)) & (((uint64_t)1 << 32) - 1)))
-#define CIX_BOOK_SELL_SCORE(O) (((((uint64_t)(O)->data.price)) << 32) | \
-	((O)->recv_time & (((uint64_t)1 << 32) - 1)))
+#define CIX_BOOK_MAP_BITS	64
+#define CIX_BOOK_MAP_WORD(I)	((I) / CIX_BOOK_MAP_BITS)
+#define CIX_BOOK_MAP_BIT(I)	((uint64_t)1 << ((I) % CIX_BOOK_MAP_BITS))
 
+/*
+ * Orders are split in two.  struct cix_order holds only what the matching
+ * loop reads for every resting order it walks past, and is sized so that
+ * two fit in a cache line.  Everything else lives in struct
+ * cix_order_info, which is only read when an order executes or is
+ * entered, cancelled or replaced.
+ */
 struct cix_order {
+	/* Neighboring orders at the same price level, in time priority */
+	struct cix_order *next;
+	struct cix_order *prev;
+
+	struct cix_order_info *info;
+	cix_price_t price;
+
+	/*
+	 * Shares remaining to be executed.  Once this reaches 0, the
+	 * entire order has been traded and should be removed from
+	 * the order book.
+	 */
+	cix_quantity_t remaining;
+};
+
+struct cix_order_info {
 	struct cix_message_order data;
 	cix_order_id_t id;
+	struct cix_book *book;
 
 	/*
 	 * Session that received this order.  Used for sending acks,
@@ -37,21 +64,512 @@ struct cix_order {
 	 * ordered by this value.
 	 */
 	uint64_t recv_time;
-	
-	/*
-	 * Shares remaining to be executed.  Once this reaches 0, the
-	 * entire order has been traded and should be removed from
-	 * the order book.
-	 */
-	cix_quantity_t remaining;
 };
 
+const size_t cix_book_order_size = sizeof(struct cix_order);
+const size_t cix_book_order_info_size = sizeof(struct cix_order_info);
+
 static struct cix_id_generator cix_exec_id_gen =
     CIX_ID_GENERATOR_INITIALIZER(1 << 14);
 
+static struct cix_order *
+cix_book_order_alloc(const struct cix_book_context *context)
+{
+	struct cix_order *order = cix_slab_alloc(context->pool);
+
+	if (order == NULL) {
+		return NULL;
+	}
+
+	order->info = cix_slab_alloc(context->info_pool);
+	if (order->info == NULL) {
+		cix_slab_free(context->pool, order);
+		return NULL;
+	}
+
+	order->info->session = NULL;
+	return order;
+}
+
+/*
+ * An order holds a reference to its session from the time that it is
+ * accepted, so that reports for it can still be queued after the session
+ * disconnects.
+ */
+static void
+cix_book_order_free(const struct cix_book_context *context,
+    struct cix_order *order)
+{
+
+	if (order->info->session != NULL) {
+		cix_session_release(order->info->session, 1);
+	}
+
+	cix_slab_free(context->info_pool, order->info);
+	cix_slab_free(context->pool, order);
+	return;
+}
+
+static bool
+cix_book_side_init(struct cix_book_side *side)
+{
+
+	side->levels = NULL;
+	side->map = NULL;
+	side->summary = NULL;
+
+	if (cix_vector_init(&side->sparse, sizeof(struct cix_book_level),
+	    CIX_BOOK_SPARSE_SIZE) == false) {
+		return false;
+	}
+
+	return true;
+}
+
+static void
+cix_book_level_destroy(struct cix_book *book, struct cix_book_level *level)
+{
+	struct cix_order *order, *next;
+
+	for (order = level->head; order != NULL; order = next) {
+		next = order->next;
+		(void)cix_order_index_remove(book->context.orders,
+		    order->info->id);
+		cix_book_order_free(&book->context, order);
+	}
+
+	level->head = NULL;
+	level->tail = NULL;
+	level->quantity = 0;
+	return;
+}
+
+static void
+cix_book_side_destroy(struct cix_book *book, struct cix_book_side *side)
+{
+	struct cix_book_level *level;
+	unsigned int i;
+
+	if (side->levels != NULL) {
+		for (i = 0; i < book->ladder_size; ++i) {
+			cix_book_level_destroy(book, &side->levels[i]);
+		}
+	}
+
+	if (side->sparse != NULL) {
+		CIX_VECTOR_FOREACH(level, side->sparse) {
+			cix_book_level_destroy(book, level);
+		}
+	}
+
+	free(side->levels);
+	free(side->map);
+	free(side->summary);
+	cix_vector_destroy(&side->sparse);
+
+	side->levels = NULL;
+	side->map = NULL;
+	side->summary = NULL;
+	return;
+}
+
+/*
+ * Allocate the ladder for one side of the book.  This is deferred until
+ * the first order so that books for inactive symbols stay small and so
+ * that the ladder can be centered on the first traded price.
+ */
+static bool
+cix_book_side_ladder(struct cix_book *book, struct cix_book_side *side)
+{
+	unsigned int i;
+	unsigned int n_map = book->ladder_size / CIX_BOOK_MAP_BITS;
+	unsigned int n_summary = (n_map + CIX_BOOK_MAP_BITS - 1) /
+	    CIX_BOOK_MAP_BITS;
+
+	side->levels = malloc(book->ladder_size * sizeof *side->levels);
+	side->map = calloc(n_map, sizeof *side->map);
+	side->summary = calloc(n_summary, sizeof *side->summary);
+
+	if (side->levels == NULL || side->map == NULL ||
+	    side->summary == NULL) {
+		fprintf(stderr, "failed to allocate price ladder\n");
+		free(side->levels);
+		free(side->map);
+		free(side->summary);
+		side->levels = NULL;
+		side->map = NULL;
+		side->summary = NULL;
+		return false;
+	}
+
+	for (i = 0; i < book->ladder_size; ++i) {
+		struct cix_book_level *level = &side->levels[i];
+
+		level->head = NULL;
+		level->tail = NULL;
+		level->price = book->ladder_base + i;
+		level->quantity = 0;
+	}
+
+	return true;
+}
+
+static bool
+cix_book_ladder_init(struct cix_book *book, cix_price_t price)
+{
+
+	if (book->ladder_base == 0) {
+		unsigned int half = book->ladder_size >> 1;
+
+		book->ladder_base = price > half ? price - half : 0;
+	}
+
+	if (book->ladder_base > UINT32_MAX - book->ladder_size) {
+		book->ladder_base = UINT32_MAX - book->ladder_size;
+	}
+
+	if (cix_book_side_ladder(book, &book->bid) == false) {
+		return false;
+	}
+
+	if (cix_book_side_ladder(book, &book->offer) == false) {
+		cix_book_side_destroy(book, &book->bid);
+		return false;
+	}
+
+	return true;
+}
+
+static inline bool
+cix_book_ladder_contains(const struct cix_book *book, cix_price_t price)
+{
+
+	return price - book->ladder_base < book->ladder_size;
+}
+
+static inline void
+cix_book_ladder_set(struct cix_book_side *side, unsigned int index)
+{
+	unsigned int word = CIX_BOOK_MAP_WORD(index);
+
+	side->map[word] |= CIX_BOOK_MAP_BIT(index);
+	side->summary[CIX_BOOK_MAP_WORD(word)] |= CIX_BOOK_MAP_BIT(word);
+	return;
+}
+
+static inline void
+cix_book_ladder_clear(struct cix_book_side *side, unsigned int index)
+{
+	unsigned int word = CIX_BOOK_MAP_WORD(index);
+
+	side->map[word] &= ~CIX_BOOK_MAP_BIT(index);
+	if (side->map[word] == 0) {
+		side->summary[CIX_BOOK_MAP_WORD(word)] &=
+		    ~CIX_BOOK_MAP_BIT(word);
+	}
+
+	return;
+}
+
+/*
+ * Lowest non-empty ladder level, or NULL if the ladder is empty.
+ * With the default ladder size the summary is a single word, so this is
+ * two bit scans.
+ */
+static struct cix_book_level *
+cix_book_ladder_first(const struct cix_book *book,
+    const struct cix_book_side *side)
+{
+	unsigned int n_map = book->ladder_size / CIX_BOOK_MAP_BITS;
+	unsigned int n_summary = (n_map + CIX_BOOK_MAP_BITS - 1) /
+	    CIX_BOOK_MAP_BITS;
+	unsigned int i;
+
+	for (i = 0; i < n_summary; ++i) {
+		unsigned int word;
+
+		if (side->summary[i] == 0)
+			continue;
+
+		word = i * CIX_BOOK_MAP_BITS +
+		    __builtin_ctzll(side->summary[i]);
+		return &side->levels[word * CIX_BOOK_MAP_BITS +
+		    __builtin_ctzll(side->map[word])];
+	}
+
+	return NULL;
+}
+
+/*
+ * Highest non-empty ladder level, or NULL if the ladder is empty.
+ */
+static struct cix_book_level *
+cix_book_ladder_last(const struct cix_book *book,
+    const struct cix_book_side *side)
+{
+	unsigned int n_map = book->ladder_size / CIX_BOOK_MAP_BITS;
+	unsigned int i = (n_map + CIX_BOOK_MAP_BITS - 1) / CIX_BOOK_MAP_BITS;
+
+	while (i-- > 0) {
+		unsigned int word;
+
+		if (side->summary[i] == 0)
+			continue;
+
+		word = i * CIX_BOOK_MAP_BITS + (CIX_BOOK_MAP_BITS - 1) -
+		    __builtin_clzll(side->summary[i]);
+		return &side->levels[word * CIX_BOOK_MAP_BITS +
+		    (CIX_BOOK_MAP_BITS - 1) - __builtin_clzll(side->map[word])];
+	}
+
+	return NULL;
+}
+
+/*
+ * Sparse levels are sorted so that the best price is always last:
+ * ascending for bids and descending for offers.
+ */
+static inline bool
+cix_book_sparse_before(const struct cix_book *book,
+    const struct cix_book_side *side, cix_price_t a, cix_price_t b)
+{
+
+	return side == &book->bid ? a < b : a > b;
+}
+
+/*
+ * Index of the first sparse level that is not before the given price.
+ */
+static unsigned int
+cix_book_sparse_search(const struct cix_book *book,
+    const struct cix_book_side *side, cix_price_t price)
+{
+	unsigned int low = 0;
+	unsigned int high = cix_vector_length(side->sparse);
+
+	while (low < high) {
+		unsigned int mid = low + ((high - low) >> 1);
+		struct cix_book_level *level =
+		    cix_vector_item(side->sparse, mid);
+
+		if (cix_book_sparse_before(book, side, level->price, price)) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+static struct cix_book_level *
+cix_book_sparse_best(const struct cix_book_side *side)
+{
+	unsigned int length = cix_vector_length(side->sparse);
+
+	return length == 0 ? NULL : cix_vector_item(side->sparse, length - 1);
+}
+
+/*
+ * Return the best (highest bid or lowest offer) non-empty level on the
+ * given side, or NULL if that side of the book is empty.
+ */
+static struct cix_book_level *
+cix_book_best(const struct cix_book *book, const struct cix_book_side *side)
+{
+	struct cix_book_level *sparse = cix_book_sparse_best(side);
+	struct cix_book_level *ladder;
+
+	/* The ladder is only allocated by the first limit order. */
+	if (side->levels == NULL) {
+		return sparse;
+	}
+
+	/*
+	 * A sparse level outside the ladder window on the aggressive side
+	 * (above it for bids, below it for offers) beats anything in the
+	 * ladder.
+	 */
+	if (sparse != NULL && cix_book_sparse_before(book, side,
+	    side == &book->bid ? book->ladder_base + book->ladder_size - 1 :
+	    book->ladder_base, sparse->price)) {
+		return sparse;
+	}
+
+	ladder = side == &book->bid ? cix_book_ladder_last(book, side) :
+	    cix_book_ladder_first(book, side);
+
+	return ladder != NULL ? ladder : sparse;
+}
+
+/*
+ * Find the level for the given price, creating an empty one if needed.
+ * Returns NULL if memory cannot be allocated for a new sparse level.
+ */
+static struct cix_book_level *
+cix_book_level(struct cix_book *book, struct cix_book_side *side,
+    cix_price_t price)
+{
+	struct cix_book_level *level;
+	unsigned int index;
+
+	if (cix_book_ladder_contains(book, price)) {
+		return &side->levels[price - book->ladder_base];
+	}
+
+	index = cix_book_sparse_search(book, side, price);
+	level = cix_vector_item(side->sparse, index);
+	if (level != NULL && level->price == price) {
+		return level;
+	}
+
+	level = cix_vector_insert(&side->sparse, index);
+	if (level == NULL) {
+		fprintf(stderr, "failed to create price level\n");
+		return NULL;
+	}
+
+	level->head = NULL;
+	level->tail = NULL;
+	level->price = price;
+	level->quantity = 0;
+	return level;
+}
+
+/*
+ * Called once the last order has been removed from a level.
+ */
+static void
+cix_book_level_empty(struct cix_book *book, struct cix_book_side *side,
+    struct cix_book_level *level)
+{
+
+	if (cix_book_ladder_contains(book, level->price)) {
+		cix_book_ladder_clear(side, level - side->levels);
+		return;
+	}
+
+	cix_vector_remove(side->sparse, (unsigned int)
+	    ((unsigned char *)level - side->sparse->data) /
+	    side->sparse->item_size);
+	return;
+}
+
+static void
+cix_book_level_unlink(struct cix_book_level *level, struct cix_order *order)
+{
+
+	if (order->prev == NULL) {
+		level->head = order->next;
+	} else {
+		order->prev->next = order->next;
+	}
+
+	if (order->next == NULL) {
+		level->tail = order->prev;
+	} else {
+		order->next->prev = order->prev;
+	}
+
+	level->quantity -= order->remaining;
+	return;
+}
+
+/*
+ * Add an order to the back of the queue at its price level.
+ */
+static bool
+cix_book_rest(struct cix_book *book, struct cix_book_side *side,
+    struct cix_order *order)
+{
+	struct cix_book_level *level;
+
+	level = cix_book_level(book, side, order->price);
+	if (level == NULL) {
+		return false;
+	}
+
+	if (cix_order_index_insert(book->context.orders, order->info->id,
+	    order) == false) {
+		if (level->head == NULL) {
+			cix_book_level_empty(book, side, level);
+		}
+
+		return false;
+	}
+
+	order->next = NULL;
+	order->prev = level->tail;
+	if (level->tail == NULL) {
+		level->head = order;
+
+		if (cix_book_ladder_contains(book, order->price)) {
+			cix_book_ladder_set(side, level - side->levels);
+		}
+	} else {
+		level->tail->next = order;
+	}
+
+	level->tail = order;
+	level->quantity += order->remaining;
+	return true;
+}
+
+/*
+ * Publish the current top of book if it has changed.  Only the thread that
+ * owns the book may call this.
+ */
+static void
+cix_book_bbo_update(struct cix_book *book)
+{
+	struct cix_book_level *bid = cix_book_best(book, &book->bid);
+	struct cix_book_level *offer = cix_book_best(book, &book->offer);
+	struct cix_book_bbo *bbo = &book->bbo.data;
+	cix_price_t bid_price = bid != NULL ? bid->price : 0;
+	cix_price_t offer_price = offer != NULL ? offer->price : 0;
+	uint64_t bid_size = bid != NULL ? bid->quantity : 0;
+	uint64_t offer_size = offer != NULL ? offer->quantity : 0;
+
+	if (bbo->bid == bid_price && bbo->offer == offer_price &&
+	    bbo->bid_size == bid_size && bbo->offer_size == offer_size) {
+		return;
+	}
+
+	ck_sequence_write_begin(&book->bbo.lock);
+	bbo->sequence++;
+	bbo->bid = bid_price;
+	bbo->offer = offer_price;
+	bbo->bid_size = bid_size;
+	bbo->offer_size = offer_size;
+	ck_sequence_write_end(&book->bbo.lock);
+	return;
+}
+
+void
+cix_book_bbo(const struct cix_book *book, struct cix_book_bbo *bbo)
+{
+	unsigned int version;
+
+	do {
+		version = ck_sequence_read_begin(&book->bbo.lock);
+		*bbo = book->bbo.data;
+	} while (ck_sequence_read_retry(&book->bbo.lock, version) == true);
+
+	return;
+}
+
+bool
+cix_book_empty(const struct cix_book *book)
+{
+
+	return cix_book_best(book, &book->bid) == NULL &&
+	    cix_book_best(book, &book->offer) == NULL;
+}
+
 bool
-cix_book_init(struct cix_book *book, cix_symbol_t *symbol,
-    struct cix_trade_log_manager *trade_log)
+cix_book_init(struct cix_book *book, cix_symbol_t *symbol, unsigned int index,
+    const struct cix_book_config *config,
+    const struct cix_book_context *context)
 {
 
 	strncpy(book->symbol.symbol, symbol->symbol,
@@ -62,17 +580,39 @@ cix_book_init(struct cix_book *book, cix_symbol_t *symbol,
 		return false;
 	}
 
-	if (cix_heap_init(&book->bid, false,
-	    CIX_BOOK_DEFAULT_HEAP_SIZE) == false) {
+	if (index > CIX_BOOK_MAX_INDEX) {
+		fprintf(stderr, "book index %u exceeds maximum %u\n", index,
+		    CIX_BOOK_MAX_INDEX);
 		return false;
 	}
 
-	if (cix_heap_init(&book->offer, true,
-	    CIX_BOOK_DEFAULT_HEAP_SIZE) == false) {
+	if (config->ladder_size < CIX_BOOK_MAP_BITS ||
+	    (config->ladder_size & (config->ladder_size - 1)) != 0) {
+		fprintf(stderr, "ladder size %u must be a power of two of at "
+		    "least %u\n", config->ladder_size, CIX_BOOK_MAP_BITS);
 		return false;
 	}
 
-	book->trade_log = trade_log;
+	book->index = index;
+	book->ladder_base = config->ladder_base;
+	book->ladder_size = config->ladder_size;
+	book->phase = CIX_BOOK_PHASE_CONTINUOUS;
+	book->recv_counter = 0;
+	book->auction_volume = NULL;
+
+	book->bid.sparse = NULL;
+	book->offer.sparse = NULL;
+	if (cix_book_side_init(&book->bid) == false ||
+	    cix_book_side_init(&book->offer) == false) {
+		fprintf(stderr, "failed to initialize book levels\n");
+		cix_vector_destroy(&book->bid.sparse);
+		return false;
+	}
+
+	book->context = *context;
+
+	ck_sequence_init(&book->bbo.lock);
+	memset(&book->bbo.data, 0, sizeof book->bbo.data);
 	cix_id_block_init(&book->id_block);
 	return true;
 }
@@ -81,8 +621,10 @@ void
 cix_book_destroy(struct cix_book *book)
 {
 
-	cix_heap_destroy(&book->bid);
-	cix_heap_destroy(&book->offer);
+	cix_book_side_destroy(book, &book->bid);
+	cix_book_side_destroy(book, &book->offer);
+	free(book->auction_volume);
+	book->auction_volume = NULL;
 
 	return;
 }
@@ -103,8 +645,8 @@ cix_book_execution(struct cix_book *book, struct cix_order *bid,
 		fprintf(stderr, "failed to generate execution ID\n");
 	}
 
-	execution.buyer = bid->user;
-	execution.seller = offer->user;
+	execution.buyer = bid->info->user;
+	execution.seller = offer->info->user;
 	memcpy(execution.symbol.symbol, book->symbol.symbol,
 	    sizeof execution.symbol.symbol);
 	execution.quantity = min(bid->remaining, offer->remaining);
@@ -116,7 +658,8 @@ cix_book_execution(struct cix_book *book, struct cix_order *bid,
 	 * XXX: Offload logging to a separate thread to allow for timestamping
 	 * and other more expensive operations.
 	 */
-	if (cix_trade_log_execution(book->trade_log, &execution) == false) {
+	if (cix_trade_log_execution(book->context.trade_log, &execution) ==
+	    false) {
 		fprintf(stderr, "!!!failed to log execution!!!\n");
 		exit(EXIT_FAILURE);
 	}
@@ -124,99 +667,480 @@ cix_book_execution(struct cix_book *book, struct cix_order *bid,
 	bid->remaining -= execution.quantity;
 	offer->remaining -= execution.quantity;
 
-	if ((cix_session_execution_report(bid->session, bid->id,
-	    execution.price, execution.quantity) == false) |
-	    (cix_session_execution_report(offer->session, offer->id,
-	    execution.price, execution.quantity) == false)) {
+	if ((cix_session_execution_report(bid->info->session, bid->info->id,
+	    execution.price, execution.quantity, book->context.batch) ==
+	    false) |
+	    (cix_session_execution_report(offer->info->session,
+	    offer->info->id,
+	    execution.price, execution.quantity, book->context.batch) ==
+	    false)) {
 		fprintf(stderr, "failed to report execution to clients\n");
 	}
 
 	return true;
 }
 
-static bool
+/*
+ * Match an incoming order against the resting orders at a single level of
+ * the opposite side, in time priority, until either is exhausted.
+ */
+static void
+cix_book_level_match(struct cix_book *book, struct cix_book_level *level,
+    struct cix_order *order)
+{
+
+	while (order->remaining > 0 && level->head != NULL) {
+		struct cix_order *resting = level->head;
+		cix_quantity_t remaining = resting->remaining;
+
+		if (order->info->data.side == CIX_TRADE_SIDE_BUY) {
+			cix_book_execution(book, order, resting, level->price);
+		} else {
+			cix_book_execution(book, resting, order, level->price);
+		}
+
+		level->quantity -= remaining - resting->remaining;
+		if (resting->remaining > 0)
+			break;
+
+		cix_book_level_unlink(level, resting);
+		(void)cix_order_index_remove(book->context.orders,
+		    resting->info->id);
+
+		cix_book_order_free(&book->context, resting);
+	}
+
+	return;
+}
+
+static void
 cix_book_buy(struct cix_book *book, struct cix_order *bid)
 {
-	struct cix_order *offer;
-	
-	offer = cix_heap_peek(&book->offer);
-	while (bid->remaining > 0 && offer != NULL &&
-	    bid->data.price >= offer->data.price) {
-		if (cix_book_execution(book, bid, offer, offer->data.price) ==
-		    false) {
-			free(bid);
-			return false;
+	struct cix_book_level *level;
+
+	while (bid->remaining > 0) {
+		level = cix_book_best(book, &book->offer);
+		if (level == NULL || bid->price < level->price)
+			break;
+
+		cix_book_level_match(book, level, bid);
+		if (level->head == NULL) {
+			cix_book_level_empty(book, &book->offer, level);
 		}
+	}
+
+	return;
+}
+
+static void
+cix_book_sell(struct cix_book *book, struct cix_order *offer)
+{
+	struct cix_book_level *level;
 
-		if (offer->remaining > 0)
+	while (offer->remaining > 0) {
+		level = cix_book_best(book, &book->bid);
+		if (level == NULL || offer->price > level->price)
 			break;
 
-		(void)cix_heap_pop(&book->offer);
-		free(offer);
-		offer = cix_heap_peek(&book->offer);
+		cix_book_level_match(book, level, offer);
+		if (level->head == NULL) {
+			cix_book_level_empty(book, &book->bid, level);
+		}
 	}
 
-	if (bid->remaining == 0) {
-		free(bid);
-	} else if (cix_heap_push(&book->bid, bid, CIX_BOOK_BUY_SCORE(bid)) ==
-	    false) {
+	return;
+}
+
+/*
+ * Execute an order against the opposite side of the book for as much as
+ * its price allows, without resting any remainder.
+ */
+static void
+cix_book_cross(struct cix_book *book, struct cix_order *order)
+{
+
+	switch (order->info->data.side) {
+	case CIX_TRADE_SIDE_BUY:
+		cix_book_buy(book, order);
+		break;
+	case CIX_TRADE_SIDE_SELL:
+		cix_book_sell(book, order);
+		break;
+	default:
+		fprintf(stderr, "unknown trade side %u\n",
+		    order->info->data.side);
+		abort();
+		break;
+	}
+
+	return;
+}
+
+/*
+ * Match an order against the opposite side of the book and rest whatever
+ * remains.  On success the book has taken ownership of the order.
+ */
+static bool
+cix_book_match(struct cix_book *book, struct cix_order *order)
+{
+
+	if (book->phase == CIX_BOOK_PHASE_CONTINUOUS) {
+		cix_book_cross(book, order);
+		if (order->remaining == 0) {
+			cix_book_order_free(&book->context, order);
+			return true;
+		}
+	}
+
+	return cix_book_rest(book, order->info->data.side ==
+	    CIX_TRADE_SIDE_BUY ? &book->bid : &book->offer, order);
+}
+
+void
+cix_book_auction(struct cix_book *book)
+{
+
+	book->phase = CIX_BOOK_PHASE_AUCTION;
+	return;
+}
+
+/*
+ * Total quantity of sparse levels that are better than every ladder price,
+ * i.e. bids above the window or offers below it.  These are executable at
+ * any clearing price inside the window.
+ */
+static uint64_t
+cix_book_sparse_outside(const struct cix_book *book,
+    const struct cix_book_side *side)
+{
+	struct cix_book_level *level;
+	uint64_t quantity = 0;
+
+	CIX_VECTOR_FOREACH(level, side->sparse) {
+		if (cix_book_sparse_before(book, side, side == &book->bid ?
+		    book->ladder_base + book->ladder_size - 1 :
+		    book->ladder_base, level->price)) {
+			quantity += level->quantity;
+		}
+	}
+
+	return quantity;
+}
+
+/*
+ * Volume on one side that is willing to trade at a price outside the
+ * ladder window.  The whole ladder, whose total is given, lies on one
+ * side of such a price, so only the sparse levels need to be compared.
+ */
+static uint64_t
+cix_book_sparse_volume(const struct cix_book *book,
+    const struct cix_book_side *side, uint64_t ladder, cix_price_t price)
+{
+	struct cix_book_level *level;
+	bool bid = side == &book->bid;
+	uint64_t quantity = 0;
+
+	if (bid ? price < book->ladder_base : price >= book->ladder_base) {
+		quantity = ladder;
+	}
+
+	CIX_VECTOR_FOREACH(level, side->sparse) {
+		if (bid ? level->price >= price : level->price <= price) {
+			quantity += level->quantity;
+		}
+	}
+
+	return quantity;
+}
+
+/*
+ * Find the price that maximizes executable volume, breaking ties by the
+ * smallest imbalance between the two sides and then by the lowest price.
+ * Every ladder price is a candidate, as is every sparse level, since a
+ * cross may lie entirely outside the window.  Returns false if nothing is
+ * executable.
+ */
+static bool
+cix_book_clearing_price(const struct cix_book *book, uint64_t *bids,
+    uint64_t *offers, cix_price_t *price)
+{
+	const struct cix_book_side *sides[] = { &book->bid, &book->offer };
+	struct cix_book_level *level;
+	unsigned int i, n = book->ladder_size;
+	unsigned int best = 0;
+	uint64_t bid_ladder = 0, offer_ladder = 0;
+	uint64_t volume, imbalance;
+	cix_price_t clearing;
+	uint64_t sum;
+
+	/*
+	 * Cumulative volume willing to trade at each price: bids at or above
+	 * it and offers at or below it.
+	 */
+	sum = cix_book_sparse_outside(book, &book->offer);
+	for (i = 0; i < n; ++i) {
+		offer_ladder += book->offer.levels[i].quantity;
+		offers[i] = sum + offer_ladder;
+	}
+
+	sum = cix_book_sparse_outside(book, &book->bid);
+	for (i = n; i-- > 0;) {
+		bid_ladder += book->bid.levels[i].quantity;
+		bids[i] = sum + bid_ladder;
+	}
+
+	/*
+	 * Replace the cumulative volumes with executable volume and imbalance.
+	 * There is no dependency between iterations so this vectorizes.
+	 */
+	for (i = 0; i < n; ++i) {
+		uint64_t bid = bids[i], offer = offers[i];
+
+		bids[i] = bid < offer ? bid : offer;
+		offers[i] = bid < offer ? offer - bid : bid - offer;
+	}
+
+	for (i = 1; i < n; ++i) {
+		if (bids[i] > bids[best] ||
+		    (bids[i] == bids[best] && offers[i] < offers[best])) {
+			best = i;
+		}
+	}
+
+	volume = bids[best];
+	imbalance = offers[best];
+	clearing = book->ladder_base + best;
+
+	/*
+	 * There are usually only a handful of sparse levels, so each is
+	 * simply checked against both sides.
+	 */
+	for (i = 0; i < 2; ++i) {
+		CIX_VECTOR_FOREACH(level, sides[i]->sparse) {
+			uint64_t bid, offer, executable, difference;
+
+			bid = cix_book_sparse_volume(book, &book->bid,
+			    bid_ladder, level->price);
+			offer = cix_book_sparse_volume(book, &book->offer,
+			    offer_ladder, level->price);
+			executable = bid < offer ? bid : offer;
+			difference = bid < offer ? offer - bid : bid - offer;
+
+			if (executable > volume || (executable == volume &&
+			    (difference < imbalance || (difference ==
+			    imbalance && level->price < clearing)))) {
+				volume = executable;
+				imbalance = difference;
+				clearing = level->price;
+			}
+		}
+	}
+
+	if (volume == 0) {
 		return false;
 	}
-	
+
+	*price = clearing;
 	return true;
 }
 
-static bool
-cix_book_sell(struct cix_book *book, struct cix_order *offer)
+/*
+ * Release a resting order that has been completely filled by the uncross.
+ */
+static void
+cix_book_uncross_filled(struct cix_book *book, struct cix_book_side *side,
+    struct cix_book_level *level, struct cix_order *order)
+{
+
+	if (order->remaining > 0) {
+		return;
+	}
+
+	cix_book_level_unlink(level, order);
+	if (level->head == NULL) {
+		cix_book_level_empty(book, side, level);
+	}
+
+	(void)cix_order_index_remove(book->context.orders, order->info->id);
+	cix_book_order_free(&book->context, order);
+	return;
+}
+
+bool
+cix_book_uncross(struct cix_book *book)
 {
-	struct cix_order *bid;
+	uint64_t *volume;
+	cix_price_t price;
+
+	if (book->bid.levels == NULL) {
+		book->phase = CIX_BOOK_PHASE_CONTINUOUS;
+		return true;
+	}
 
-	bid = cix_heap_peek(&book->bid);
-	while (offer->remaining > 0 && bid != NULL &&
-	    offer->data.price <= bid->data.price) {
-		if (cix_book_execution(book, bid, offer, bid->data.price) ==
-		    false) {
-			free(offer);
+	if (book->auction_volume == NULL) {
+		book->auction_volume = malloc(2 * book->ladder_size *
+		    sizeof *book->auction_volume);
+		if (book->auction_volume == NULL) {
+			fprintf(stderr, "failed to allocate auction volume\n");
 			return false;
 		}
+	}
+
+	volume = book->auction_volume;
+
+	if (cix_book_clearing_price(book, volume, volume + book->ladder_size,
+	    &price) == false) {
+		goto done;
+	}
 
-		if (bid->remaining > 0)
+	/*
+	 * Match the best orders on each side in price-time priority until one
+	 * side has no more volume that is executable at the clearing price.
+	 */
+	for (;;) {
+		struct cix_book_level *bid_level, *offer_level;
+		struct cix_order *bid, *offer;
+		cix_quantity_t quantity;
+
+		bid_level = cix_book_best(book, &book->bid);
+		offer_level = cix_book_best(book, &book->offer);
+		if (bid_level == NULL || offer_level == NULL ||
+		    bid_level->price < price || offer_level->price > price)
 			break;
 
-		(void)cix_heap_pop(&book->bid);
-		free(bid);
-		bid = cix_heap_peek(&book->bid);
+		bid = bid_level->head;
+		offer = offer_level->head;
+		quantity = min(bid->remaining, offer->remaining);
+
+		cix_book_execution(book, bid, offer, price);
+		bid_level->quantity -= quantity;
+		offer_level->quantity -= quantity;
+
+		cix_book_uncross_filled(book, &book->bid, bid_level, bid);
+		cix_book_uncross_filled(book, &book->offer, offer_level, offer);
 	}
 
-	if (offer->remaining == 0) {
-		free(offer);
-	} else if (cix_heap_push(&book->offer, offer,
-	    CIX_BOOK_SELL_SCORE(offer)) == false) {
+done:
+	book->phase = CIX_BOOK_PHASE_CONTINUOUS;
+	cix_book_bbo_update(book);
+	return true;
+}
+
+/*
+ * Order IDs come from the same sequence as execution IDs, and fail once
+ * that sequence would run into the book index in the top bits.
+ */
+static bool
+cix_book_order_id(struct cix_book *book, cix_order_id_t *id)
+{
+
+	if (cix_id_next(&cix_exec_id_gen, &book->id_block, id) == false) {
+		fprintf(stderr, "failed to generate order ID\n");
+		return false;
+	}
+
+	if (*id >> CIX_BOOK_ID_SHIFT != 0) {
+		fprintf(stderr, "order ID sequence exhausted\n");
 		return false;
 	}
 
+	*id |= (cix_order_id_t)book->index << CIX_BOOK_ID_SHIFT;
 	return true;
 }
 
+/*
+ * Handle an IOC or market order.  These never rest, so the order is matched
+ * from a copy on the stack and nothing is allocated.  Any unfilled quantity
+ * is reported back to the session as cancelled.
+ */
+static bool
+cix_book_order_immediate(struct cix_book *book,
+    struct cix_message_order *message, struct cix_session *session)
+{
+	struct cix_order order;
+	struct cix_order_info info;
+
+	if (message->type != CIX_ORDER_TYPE_IOC &&
+	    message->type != CIX_ORDER_TYPE_MARKET) {
+		fprintf(stderr, "unknown order type %u\n", message->type);
+		return cix_session_ack_report(session, message->external_id, 0,
+		    CIX_ORDER_STATUS_ERROR, book->context.batch);
+	}
+
+	/* There is nothing to match against during an auction. */
+	if (book->phase == CIX_BOOK_PHASE_AUCTION) {
+		return cix_session_ack_report(session, message->external_id, 0,
+		    CIX_ORDER_STATUS_ERROR, book->context.batch);
+	}
+
+	memcpy(&info.data, message, sizeof info.data);
+	order.price = message->price;
+	if (message->type == CIX_ORDER_TYPE_MARKET) {
+		order.price = message->side == CIX_TRADE_SIDE_BUY ?
+		    UINT32_MAX : 0;
+	}
+
+	if (cix_book_order_id(book, &info.id) == false) {
+		return false;
+	}
+
+	if (cix_session_ack_report(session, message->external_id, info.id,
+	    CIX_ORDER_STATUS_OK, book->context.batch) == false) {
+		fprintf(stderr, "failed to report ack for order %s\n",
+		    message->external_id);
+		return false;
+	}
+
+	info.book = book;
+	info.session = session;
+	info.user = cix_session_user_id(session);
+	info.recv_time = book->recv_counter++;
+
+	order.next = NULL;
+	order.prev = NULL;
+	order.info = &info;
+	order.remaining = message->quantity;
+
+	/* An empty book has no ladder yet and nothing to match. */
+	if (book->bid.levels != NULL) {
+		cix_book_cross(book, &order);
+		cix_book_bbo_update(book);
+	}
+
+	if (order.remaining == 0) {
+		return true;
+	}
+
+	return cix_session_cancel_report(session, info.id, order.remaining,
+	    CIX_ORDER_STATUS_OK, book->context.batch);
+}
+
 bool
 cix_book_order(struct cix_book *book, struct cix_message_order *message,
     struct cix_session *session)
 {
-	/* XXX: slab allocation */
-	struct cix_order *order = malloc(sizeof *order);
+	struct cix_order *order;
 	bool result = false;
 	cix_order_id_t internal_id;
 
+	if (message->type != CIX_ORDER_TYPE_LIMIT) {
+		return cix_book_order_immediate(book, message, session);
+	}
+
+	order = cix_book_order_alloc(&book->context);
 	if (order == NULL) {
 		fprintf(stderr, "failed to allocate memory for order\n");
-		goto done;
+		return false;
 	}
 
-	memcpy(&order->data, message, sizeof order->data);
+	memcpy(&order->info->data, message, sizeof order->info->data);
 
-	if (cix_id_next(&cix_exec_id_gen, &book->id_block, &internal_id) ==
-	    false) {
-		fprintf(stderr, "failed to generate order ID\n");
+	if (book->bid.levels == NULL &&
+	    cix_book_ladder_init(book, message->price) == false) {
+		goto done;
+	}
+
+	if (cix_book_order_id(book, &internal_id) == false) {
 		goto done;
 	}
 
@@ -226,34 +1150,337 @@ cix_book_order(struct cix_book *book, struct cix_message_order *message,
 	 * error processing the order, we can send a bust message later.
 	 */
 	if (cix_session_ack_report(session, message->external_id,
-	    internal_id, CIX_ORDER_STATUS_OK) == false) {
+	    internal_id, CIX_ORDER_STATUS_OK, book->context.batch) == false) {
 		fprintf(stderr, "failed to report ack for order %s\n",
 		    message->external_id);
 		goto done;
 	}
 	
-	order->session = session;
-	order->user = cix_session_user_id(session);
-	order->remaining = order->data.quantity;
-	order->recv_time = book->recv_counter++;
+	order->info->id = internal_id;
+	order->info->book = book;
+	order->info->session = session;
+	order->info->user = cix_session_user_id(session);
+	order->info->recv_time = book->recv_counter++;
+	order->price = message->price;
+	cix_session_hold(session, 1);
+	order->remaining = message->quantity;
 
-	switch (order->data.side) {
-	case CIX_TRADE_SIDE_BUY:
-		result = cix_book_buy(book, order);
-		break;
-	case CIX_TRADE_SIDE_SELL:
-		result = cix_book_sell(book, order);
-		break;
-	default:
-		fprintf(stderr, "unknown trade side %u\n", order->data.side);
-		abort();
-		break;
+	/* The order was already acked, so report it as gone. */
+	result = cix_book_match(book, order);
+	if (result == false) {
+		fprintf(stderr, "failed to rest order %" CIX_PR_ID "\n",
+		    internal_id);
+		(void)cix_session_cancel_report(session, internal_id,
+		    order->remaining, CIX_ORDER_STATUS_OK, book->context.batch);
 	}
 
+	cix_book_bbo_update(book);
+
 done:
 	if (result == false) {
-		free(order);
+		cix_book_order_free(&book->context, order);
 	}
 
 	return result;
 }
+
+/*
+ * A resting order in transit between market threads.
+ */
+struct cix_book_transfer {
+	struct cix_order_info info;
+	cix_price_t price;
+	cix_quantity_t remaining;
+};
+
+static unsigned int
+cix_book_level_count(const struct cix_book_level *level)
+{
+	const struct cix_order *order;
+	unsigned int count = 0;
+
+	for (order = level->head; order != NULL; order = order->next) {
+		++count;
+	}
+
+	return count;
+}
+
+/*
+ * Copy every order at a level into the transfer vector and release it.
+ * The vector has already been sized, so this cannot fail.
+ */
+static void
+cix_book_level_detach(struct cix_book *book, struct cix_book_level *level,
+    struct cix_vector **orders)
+{
+	struct cix_order *order, *next;
+
+	for (order = level->head; order != NULL; order = next) {
+		struct cix_book_transfer *transfer = cix_vector_next(orders);
+
+		next = order->next;
+		transfer->info = *order->info;
+		transfer->price = order->price;
+		transfer->remaining = order->remaining;
+
+		/* The transfer takes over the order's session reference. */
+		order->info->session = NULL;
+
+		(void)cix_order_index_remove(book->context.orders,
+		    order->info->id);
+		cix_book_order_free(&book->context, order);
+	}
+
+	level->head = NULL;
+	level->tail = NULL;
+	level->quantity = 0;
+	return;
+}
+
+bool
+cix_book_detach(struct cix_book *book, struct cix_vector **orders)
+{
+	struct cix_book_side *sides[] = { &book->bid, &book->offer };
+	struct cix_book_level *level;
+	unsigned int i, j, count = 0;
+
+	for (i = 0; i < 2; ++i) {
+		if (sides[i]->levels != NULL) {
+			for (j = 0; j < book->ladder_size; ++j) {
+				count += cix_book_level_count(
+				    &sides[i]->levels[j]);
+			}
+		}
+
+		CIX_VECTOR_FOREACH(level, sides[i]->sparse) {
+			count += cix_book_level_count(level);
+		}
+	}
+
+	if (cix_vector_init(orders, sizeof(struct cix_book_transfer),
+	    count > 0 ? count : 1) == false) {
+		fprintf(stderr, "failed to allocate book transfer\n");
+		return false;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if (sides[i]->levels != NULL) {
+			unsigned int n_map = book->ladder_size /
+			    CIX_BOOK_MAP_BITS;
+			unsigned int n_summary = (n_map + CIX_BOOK_MAP_BITS -
+			    1) / CIX_BOOK_MAP_BITS;
+
+			for (j = 0; j < book->ladder_size; ++j) {
+				cix_book_level_detach(book,
+				    &sides[i]->levels[j], orders);
+			}
+
+			memset(sides[i]->map, 0, n_map * sizeof *sides[i]->map);
+			memset(sides[i]->summary, 0,
+			    n_summary * sizeof *sides[i]->summary);
+		}
+
+		CIX_VECTOR_FOREACH(level, sides[i]->sparse) {
+			cix_book_level_detach(book, level, orders);
+		}
+
+		while (cix_vector_length(sides[i]->sparse) > 0) {
+			cix_vector_remove(sides[i]->sparse,
+			    cix_vector_length(sides[i]->sparse) - 1);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Orders that cannot be re-created on the new thread are reported to their
+ * sessions as cancelled.
+ */
+void
+cix_book_attach(struct cix_book *book, const struct cix_book_context *context,
+    struct cix_vector *orders)
+{
+	struct cix_book_transfer *transfer;
+
+	book->context = *context;
+
+	CIX_VECTOR_FOREACH(transfer, orders) {
+		struct cix_order *order = cix_book_order_alloc(context);
+		struct cix_book_side *side =
+		    transfer->info.data.side == CIX_TRADE_SIDE_BUY ?
+		    &book->bid : &book->offer;
+
+		if (order != NULL) {
+			*order->info = transfer->info;
+			order->price = transfer->price;
+			order->remaining = transfer->remaining;
+
+			if (cix_book_rest(book, side, order) == true) {
+				continue;
+			}
+
+			order->info->session = NULL;
+			cix_book_order_free(context, order);
+		}
+
+		fprintf(stderr, "failed to move order %" CIX_PR_ID "\n",
+		    transfer->info.id);
+		(void)cix_session_cancel_report(transfer->info.session,
+		    transfer->info.id, transfer->remaining,
+		    CIX_ORDER_STATUS_OK, context->batch);
+		cix_session_release(transfer->info.session, 1);
+	}
+
+	cix_vector_destroy(&orders);
+	cix_book_bbo_update(book);
+	return;
+}
+
+bool
+cix_book_clear(struct cix_book *book)
+{
+	struct cix_book_transfer *transfer;
+	struct cix_vector *orders;
+
+	if (cix_book_detach(book, &orders) == false) {
+		return false;
+	}
+
+	CIX_VECTOR_FOREACH(transfer, orders) {
+		(void)cix_session_cancel_report(transfer->info.session,
+		    transfer->info.id, transfer->remaining,
+		    CIX_ORDER_STATUS_OK, book->context.batch);
+		cix_session_release(transfer->info.session, 1);
+	}
+
+	cix_vector_destroy(&orders);
+	cix_book_bbo_update(book);
+	return true;
+}
+
+/*
+ * Take a resting order off the book and out of the order index without
+ * releasing it.
+ */
+static void
+cix_book_remove(struct cix_order *order)
+{
+	struct cix_book *book = order->info->book;
+	struct cix_book_side *side;
+	struct cix_book_level *level;
+
+	side = order->info->data.side == CIX_TRADE_SIDE_BUY ? &book->bid :
+	    &book->offer;
+
+	/* A resting order's level always exists, so this cannot allocate. */
+	level = cix_book_level(book, side, order->price);
+	cix_book_level_unlink(level, order);
+	if (level->head == NULL) {
+		cix_book_level_empty(book, side, level);
+	}
+
+	(void)cix_order_index_remove(book->context.orders, order->info->id);
+	return;
+}
+
+bool
+cix_book_cancel(const struct cix_book_context *context,
+    cix_order_id_t internal_id, struct cix_session *session)
+{
+	struct cix_order *order;
+	cix_quantity_t quantity;
+
+	order = cix_order_index_find(context->orders, internal_id);
+	if (order == NULL || order->info->session != session) {
+		return cix_session_cancel_report(session, internal_id, 0,
+		    CIX_ORDER_STATUS_ERROR, context->batch);
+	}
+
+	cix_book_remove(order);
+	cix_book_bbo_update(order->info->book);
+	quantity = order->remaining;
+	cix_book_order_free(context, order);
+
+	return cix_session_cancel_report(session, internal_id, quantity,
+	    CIX_ORDER_STATUS_OK, context->batch);
+}
+
+bool
+cix_book_replace(const struct cix_book_context *context,
+    struct cix_message_replace *replace, struct cix_session *session)
+{
+	struct cix_order *order;
+	struct cix_book *book;
+	cix_quantity_t executed, remaining;
+
+	order = cix_order_index_find(context->orders, replace->internal_id);
+	if (order == NULL || order->info->session != session) {
+		return cix_session_replace_report(session, replace->internal_id,
+		    0, replace->price, CIX_ORDER_STATUS_ERROR, context->batch);
+	}
+
+	book = order->info->book;
+	executed = order->info->data.quantity - order->remaining;
+	remaining = replace->quantity > executed ?
+	    replace->quantity - executed : 0;
+
+	if (remaining == 0) {
+		cix_book_remove(order);
+		cix_book_order_free(context, order);
+		cix_book_bbo_update(book);
+		return cix_session_replace_report(session, replace->internal_id,
+		    0, replace->price, CIX_ORDER_STATUS_OK, context->batch);
+	}
+
+	/* Reducing size in place keeps the order's queue priority. */
+	if (replace->price == order->price &&
+	    remaining <= order->remaining) {
+		struct cix_book_side *side =
+		    order->info->data.side == CIX_TRADE_SIDE_BUY ? &book->bid :
+		    &book->offer;
+		struct cix_book_level *level =
+		    cix_book_level(book, side, order->price);
+
+		level->quantity -= order->remaining - remaining;
+		order->remaining = remaining;
+		order->info->data.quantity = replace->quantity;
+		cix_book_bbo_update(book);
+		return cix_session_replace_report(session, replace->internal_id,
+		    remaining, replace->price, CIX_ORDER_STATUS_OK,
+		    context->batch);
+	}
+
+	/*
+	 * Anything else loses priority.  Ack before matching so that the ack
+	 * is ordered before any executions at the new price.
+	 */
+	cix_book_remove(order);
+	order->price = replace->price;
+	order->remaining = remaining;
+	order->info->data.price = replace->price;
+	order->info->data.quantity = replace->quantity;
+	order->info->recv_time = book->recv_counter++;
+
+	if (cix_session_replace_report(session, replace->internal_id,
+	    remaining, replace->price, CIX_ORDER_STATUS_OK, context->batch) ==
+	    false) {
+		fprintf(stderr, "failed to report replace for order %"
+		    CIX_PR_ID "\n", replace->internal_id);
+	}
+
+	/* The replace was already acked, so report the order as gone. */
+	if (cix_book_match(book, order) == false) {
+		fprintf(stderr, "failed to rest order %" CIX_PR_ID "\n",
+		    replace->internal_id);
+		(void)cix_session_cancel_report(session, replace->internal_id,
+		    order->remaining, CIX_ORDER_STATUS_OK, context->batch);
+		cix_book_order_free(context, order);
+		cix_book_bbo_update(book);
+		return false;
+	}
+
+	cix_book_bbo_update(book);
+	return true;
+}
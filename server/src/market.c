@@ -1,12 +1,24 @@
+#include <ck_cc.h>
+#include <ck_epoch.h>
+#include <ck_md.h>
+#include <ck_pr.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
 
 #include "book.h"
 #include "market.h"
 #include "messages.h"
+#include "misc.h"
+#include "order_index.h"
+#include "session.h"
+#include "slab.h"
+#include "thread.h"
 #include "trade_log.h"
 #include "vector.h"
 #include "worq.h"
@@ -14,294 +26,2138 @@
 /* XXX: Make this configurable */
 #define CIX_MARKET_DEFAULT_BOOK_COUNT 64
 #define CIX_MARKET_DEFAULT_WORQ_SIZE (1 << 16)
+#define CIX_MARKET_DEFAULT_ORDER_COUNT (1 << 16)
+#define CIX_MARKET_ORDER_CHUNK_SIZE (1 << 12)
+
+/*
+ * Queue occupancy at which a market thread starts rejecting new messages
+ * as busy, and at which it starts accepting them again.
+ */
+#define CIX_MARKET_HIGH_WATER (CIX_MARKET_DEFAULT_WORQ_SIZE / 4 * 3)
+#define CIX_MARKET_LOW_WATER (CIX_MARKET_DEFAULT_WORQ_SIZE / 4)
+
+/*
+ * Maximum number of queued messages to process before notifying the
+ * sessions that received reports.
+ */
+#define CIX_MARKET_BATCH_SIZE (1 << 6)
+
+/*
+ * Every interval the rebalancer compares the time each market thread spent
+ * processing messages and moves at most one book from the busiest thread
+ * to the idlest.  It only does so if their difference, in nanoseconds of
+ * processing per second, is at least the threshold.
+ */
+#define CIX_MARKET_REBALANCE_INTERVAL_MS 1000
+#define CIX_MARKET_REBALANCE_THRESHOLD (50 * 1000 * 1000)
+
+/* How often each thread looks for idle books to reclaim */
+#define CIX_MARKET_RECLAIM_INTERVAL_MS 1000
+
+static const struct cix_book_config cix_market_book_config = {
+	.ladder_base = 0,
+	.ladder_size = CIX_BOOK_DEFAULT_LADDER_SIZE
+};
+
+struct cix_market;
+
+enum cix_market_request {
+	CIX_MARKET_REQUEST_MESSAGE = 0,
+	CIX_MARKET_REQUEST_AUCTION,
+	CIX_MARKET_REQUEST_UNCROSS,
+	CIX_MARKET_REQUEST_RETIRE,
+	CIX_MARKET_REQUEST_MIGRATE_OUT,
+	CIX_MARKET_REQUEST_MIGRATE_IN,
+	CIX_MARKET_REQUEST_RECLAIM
+};
+
+/*
+ * Copy message by value here because its lifetime is not guaranteed
+ * by the network session.
+ */
+struct cix_market_context {
+	enum cix_market_request request;
+	union {
+		/* CIX_MARKET_REQUEST_MESSAGE */
+		struct cix_message message;
+
+		/* Book migration */
+		struct {
+			unsigned int thread;
+			struct cix_vector *orders;
+		} migrate;
+	};
+
+	/*
+	 * Symbol that the request applies to.  This is NULL for control
+	 * requests that apply to every book on the thread and for cancels
+	 * and replaces of unknown orders.
+	 */
+	struct cix_market_book *entry;
+	struct cix_session *session;
+};
+
+CIX_WORQ_DEFINE(cix_market_queue, struct cix_market_context,
+    CIX_MARKET_DEFAULT_WORQ_SIZE)
+
+/*
+ * Queue from one session thread to one market thread.  It only ever has a
+ * single producer, so sessions on different threads never contend with
+ * each other to queue messages.
+ */
+struct cix_market_lane {
+	struct cix_market_queue queue;
+
+	/* Set while the queue is between its high and low-water marks */
+	unsigned int congested;
+};
 
 struct cix_market_thread {
+	struct cix_market *market;
+
+	/*
+	 * Books owned by this thread, as struct cix_book pointers.  Only
+	 * this thread changes the vector, and it holds the lock while doing
+	 * so, which is rare, so that the rebalancer can read it.
+	 */
 	struct cix_vector *books;
-	struct cix_worq queue;
+	pthread_mutex_t books_lock;
+
+	/*
+	 * Shared by control requests, book handoffs and any session
+	 * thread without a lane of its own.
+	 */
+	struct cix_market_queue queue;
+
+	/* Set while the queue is between its high and low-water marks */
+	unsigned int congested;
+
+	/* One per session thread, polled in turn after the shared queue */
+	struct cix_market_lane *lanes;
+	unsigned int next_lane;
 
 	/*
-	 * Indicates when orders are available for processing.
-	 * XXX: Make this configurable (as opposed to busy waiting)
+	 * Indicates when orders are available for processing, unless the
+	 * thread busy-waits on its queue.
 	 */
+	struct cix_market_wait wait;
 	struct cix_event event;
 	struct cix_event_manager event_manager;
 
 	struct cix_trade_log_manager trade_log;
+
+	/* Resting orders for all books on this thread, by internal ID */
+	struct cix_order_index orders;
+	struct cix_slab order_pool;
+	struct cix_slab order_info_pool;
+	struct cix_session_batch batch;
+	struct cix_book_context book_context;
+
+	/*
+	 * Requests for books that are being moved to this thread but have
+	 * not arrived yet, in order.
+	 */
+	struct cix_vector *held;
+
+	/*
+	 * Phase of books created by this thread, as set by the last request
+	 * for every book.
+	 */
+	enum cix_book_phase phase;
+
+	/* Processing time per second over the last interval (rebalancer) */
+	uint64_t load;
+	int cpu;
 	pthread_t tid;
 };
 
-struct cix_market {
-	struct cix_market_thread *threads;
-	unsigned int n_thread;
+/*
+ * Where to find a book.  The thread is the one that requests for the book
+ * should be queued on; it only changes when the book is moved to another
+ * thread.  The book itself is only created when the symbol first trades,
+ * and it is released again once it has been idle for long enough, so it
+ * is NULL most of the time for most symbols.  Delisted symbols keep their
+ * entry, and their index, in case they are listed again.
+ */
+struct cix_market_book {
+	cix_symbol_t symbol;
+	struct cix_book *book;
+	unsigned int index;
+	unsigned int thread;
+	unsigned int retired;
+
+	/*
+	 * Set from the time requests are first routed to a new thread until
+	 * the book itself gets there.
+	 */
+	unsigned int arriving;
 };
 
 /*
- * Copy order by value here because its lifetime is not guaranteed
- * by the network session.
+ * Books are released through the market's epoch so that threads reading a
+ * book's BBO never see it freed underneath them.
  */
-struct cix_market_order_context {
-	struct cix_message_order order;
-	struct cix_session *session;
+struct cix_market_orderbook {
+	struct cix_book book;
+	ck_epoch_entry_t retire;
 };
 
-static void
-cix_market_thread_process(struct cix_event *event, cix_event_flags_t flags,
-    void *p)
-{
-	struct cix_market_thread *thread = p;
+/*
+ * Work done on a single book.  The counters are only written by the thread
+ * that owns the book.  The rest is maintained by the rebalancer.
+ */
+struct cix_market_book_load {
+	uint64_t messages;
+	uint64_t nsec;
+	uint64_t last_active;
 
-	(void)event;
-	(void)flags;
+	uint64_t last_messages;
+	uint64_t last_nsec;
+	struct cix_market_load rate;
+} CK_CC_CACHELINE;
 
-	for (;;) {
-		struct cix_market_order_context *context =
-		    cix_worq_pop(&thread->queue, CIX_WORQ_WAIT_BLOCK_SLOT);
-		struct cix_book *book;
+/*
+ * Book entries are allocated in chunks that are never moved or freed, so
+ * that requests can hold pointers to them while symbols are being listed.
+ * Chunks are mapped on demand, and load counters for symbols that never
+ * trade are never touched.
+ */
+#define CIX_MARKET_CHUNK_SHIFT	12
+#define CIX_MARKET_CHUNK_SIZE	(1u << CIX_MARKET_CHUNK_SHIFT)
+#define CIX_MARKET_CHUNK_MASK	(CIX_MARKET_CHUNK_SIZE - 1)
+#define CIX_MARKET_CHUNK_COUNT	\
+    ((CIX_BOOK_MAX_INDEX >> CIX_MARKET_CHUNK_SHIFT) + 1)
 
-		if (context == NULL)
-			break;
+struct cix_market_chunk {
+	struct cix_market_book books[CIX_MARKET_CHUNK_SIZE];
+	struct cix_market_book_load load[CIX_MARKET_CHUNK_SIZE];
+};
 
-		/*
-		 * XXX: Associate a number with each symbol and have clients
-		 * send those instead to avoid this lookup.  In the short term
-		 * we could also consider using a hash table here.
-		 */
-		CIX_VECTOR_FOREACH(book, thread->books) {
-			if (strcmp(book->symbol.symbol,
-			    context->order.symbol.symbol) != 0) {
-				continue;
-			}
+#define CIX_MARKET_SYMBOL_EMPTY	UINT_MAX
 
-			if (cix_book_order(book, &context->order,
-			    context->session) == false) {
-				fprintf(stderr, "failed to process order\n");
-			}
+/*
+ * Open-addressed table of book indexes keyed by symbol.  Slots only ever
+ * go from empty to holding an index, so a new symbol is added in place
+ * while sessions are reading the table.  Once the table is half full, a
+ * larger copy is published and the old one is freed after every reader
+ * has left it.
+ */
+struct cix_market_directory {
+	unsigned int mask;
+	unsigned int count;
+	unsigned int slots[];
+};
 
-			break;
-		}
-		
-		cix_worq_complete(&thread->queue, context);
-	}
+struct cix_market {
+	struct cix_market_thread *threads;
+	unsigned int n_thread;
 
-	return;
-}
+	/* Number of session threads that have their own lanes */
+	unsigned int n_lane;
 
-static bool
-cix_market_thread_init(struct cix_market_thread *thread, unsigned int index)
-{
-	char trade_log_path[PATH_MAX];
-	struct cix_trade_log_config config = { .path = trade_log_path };
-	int b;
+	/* Every symbol that has ever been listed, by book index */
+	struct cix_market_chunk **chunks;
+	unsigned int n_book;
 
-	if (cix_vector_init(&thread->books, sizeof(struct cix_book),
-	    CIX_MARKET_DEFAULT_BOOK_COUNT) == false) {
-		fprintf(stderr, "failed to create orderbooks\n");
-		return false;
-	}
+	/*
+	 * Used to resolve each order's book before it is queued.  Readers
+	 * look symbols up inside an epoch section.
+	 */
+	struct cix_market_directory *directory;
 
-	b = snprintf(trade_log_path, sizeof trade_log_path,
-	    "/home/brendon/source/cix/logs/%u", index);
-	if (b < 0) {
-		fprintf(stderr, "failed to create trade log path\n");
-		return false;
-	} else if ((unsigned int)b >= sizeof trade_log_path) {
-		fprintf(stderr, "trade log path exceeded maximum length\n");
-		return false;
-	}
+	/* Serializes listing and delisting symbols */
+	pthread_mutex_t listing;
 
-	if (cix_trade_log_manager_init(&thread->trade_log, &config) == false) {
-		fprintf(stderr, "failed to initialize trade log\n");
-		return false;
-	}
+	/*
+	 * Every thread that reads a book's route and queues a request for
+	 * it does so inside an epoch section, so that a book can be moved
+	 * once all requests sent along its old route have been queued.
+	 */
+	ck_epoch_t epoch;
 
-	if (cix_worq_init(&thread->queue,
-	    sizeof(struct cix_market_order_context),
-	    CIX_MARKET_DEFAULT_WORQ_SIZE) == false) {
-		fprintf(stderr, "failed to create market work queue\n");
-		return false;
-	}
+	/* Set while a book is being moved between threads */
+	unsigned int migrating;
 
-	if (cix_event_manager_init(&thread->event_manager) == false) {
-		fprintf(stderr, "failed to initialize market event manager\n");
-		return false;
-	}
+	/*
+	 * Threads that have yet to apply a request for every book.  A book
+	 * that is moving between threads would miss it, so books are not
+	 * moved while this is nonzero.
+	 */
+	unsigned int broadcasts;
 
-	if (cix_event_init_managed(&thread->event, cix_market_thread_process,
-	    thread) == false) {
-		fprintf(stderr, "failed to initialize market event listener\n");
-		return false;
-	}
+	/* Books without orders are released after this long; 0 for never */
+	uint64_t book_idle;
 
-	if (cix_worq_event_subscribe(&thread->queue, &thread->event) ==
-	    false) {
-		fprintf(stderr, "failed to subscribe to market queue\n");
-		return false;
-	}
+	pthread_t background;
+	int background_cpu;
+};
 
-	if (cix_event_add(&thread->event_manager, &thread->event) == false) {
-		fprintf(stderr, "failed to initialize market event loop\n");
-		return false;
-	}
+static inline struct cix_market_book *
+cix_market_entry(const struct cix_market *market, unsigned int index)
+{
 
-	/* XXX: cleanup in case of failure */
-	return true;
+	return &market->chunks[index >> CIX_MARKET_CHUNK_SHIFT]->
+	    books[index & CIX_MARKET_CHUNK_MASK];
 }
 
-static void
-cix_market_thread_destroy(struct cix_market_thread *thread)
+static inline struct cix_market_book_load *
+cix_market_entry_load(const struct cix_market *market, unsigned int index)
 {
-	struct cix_book *book;
 
-	CIX_VECTOR_FOREACH(book, thread->books) {
-		cix_book_destroy(book);
-	}
+	return &market->chunks[index >> CIX_MARKET_CHUNK_SHIFT]->
+	    load[index & CIX_MARKET_CHUNK_MASK];
+}
 
-	free(thread->books);
-	cix_worq_destroy(&thread->queue);
-	return;
+static void cix_market_thread_dispatch(struct cix_market_thread *,
+    struct cix_market_context *);
+
+static inline uint64_t
+cix_market_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-/*
- * XXX: Determine which thread should handle a given symbol.
- */
-static struct cix_market_thread *
-cix_market_symbol_thread(struct cix_market *market, cix_symbol_t *symbol)
+static bool
+cix_market_thread_add(struct cix_market_thread *thread, struct cix_book *book)
 {
+	bool result;
+
+	pthread_mutex_lock(&thread->books_lock);
+	result = cix_vector_append(&thread->books, &book);
+	pthread_mutex_unlock(&thread->books_lock);
+	return result;
+}
 
-	(void)market;
-	(void)symbol;
+static void
+cix_market_thread_remove(struct cix_market_thread *thread, unsigned int slot)
+{
 
-	return &market->threads[0];
+	pthread_mutex_lock(&thread->books_lock);
+	cix_vector_remove(thread->books, slot);
+	pthread_mutex_unlock(&thread->books_lock);
+	return;
 }
 
 /*
- * Allow configuration to specify any of the following options:
- * 1. Use an event loop to handle orders
- * 2. Busy wait for orders
- * 3. Spin waiting for orders but yield when queue is empty
- *
- * Right now for simplicity we will only use option 2
+ * Find the book for a symbol, creating it if this is its first request.
  */
-static void *
-cix_market_thread_run(void *p)
+static struct cix_book *
+cix_market_thread_book(struct cix_market_thread *thread,
+    struct cix_market_book *entry)
 {
-	struct cix_market_thread *thread = p;
+	struct cix_market_orderbook *orderbook;
+	struct cix_book *book = entry->book;
 
-	cix_event_manager_run(&thread->event_manager);
-	return NULL;
-}
+	/* Requests queued before the symbol was delisted are rejected. */
+	if (ck_pr_load_uint(&entry->retired) != 0) {
+		return NULL;
+	}
 
-struct cix_market *
-cix_market_init(struct cix_vector *symbols, unsigned int n_thread)
-{
-	struct cix_market *market = malloc(sizeof *market);
-	unsigned int i;
-	cix_symbol_t *symbol;
+	if (book != NULL) {
+		return book;
+	}
 
-	/* XXX */
-	if (n_thread != 1) {
-		fprintf(stderr, "multiple market threads not yet supported\n");
+	if (posix_memalign((void **)&orderbook, CK_MD_CACHELINE,
+	    sizeof *orderbook) != 0) {
+		fprintf(stderr, "failed to create orderbook for %s\n",
+		    entry->symbol.symbol);
 		return NULL;
 	}
 
-	if (market == NULL) {
-		fprintf(stderr, "failed to create market\n");
+	book = &orderbook->book;
+	if (cix_book_init(book, &entry->symbol, entry->index,
+	    &cix_market_book_config, &thread->book_context) == false) {
+		fprintf(stderr, "failed to initialize orderbook\n");
+		free(orderbook);
 		return NULL;
 	}
 
-	market->n_thread = n_thread;
-	market->threads = malloc(market->n_thread * sizeof(*market->threads));
-	if (market->threads == NULL) {
-		fprintf(stderr, "failed to create market threads\n");
-		goto fail;
+	if (cix_market_thread_add(thread, book) == false) {
+		fprintf(stderr, "failed to add orderbook\n");
+		cix_book_destroy(book);
+		free(orderbook);
+		return NULL;
 	}
 
-	for (i = 0; i < market->n_thread; ++i) {
-		struct cix_market_thread *thread = &market->threads[i];
+	if (thread->phase == CIX_BOOK_PHASE_AUCTION) {
+		cix_book_auction(book);
+	}
 
-		if (cix_market_thread_init(thread, i) == false) {
-			fprintf(stderr, "failed to initialize market thread\n");
-			goto fail;
-		}
+	ck_pr_store_ptr(&entry->book, book);
+	return book;
+}
+
+static void
+cix_market_thread_order(struct cix_market_thread *thread,
+    struct cix_market_context *context)
+{
+	struct cix_message_order *order = &context->message.payload.order;
+	struct cix_book *book = cix_market_thread_book(thread, context->entry);
+
+	if (book == NULL) {
+		(void)cix_session_ack_report(context->session,
+		    order->external_id, 0, CIX_ORDER_STATUS_ERROR,
+		    &thread->batch);
+		return;
 	}
 
-	CIX_VECTOR_FOREACH(symbol, symbols) {
-		struct cix_market_thread *thread =
-		    cix_market_symbol_thread(market, symbol);
-		struct cix_book *book = cix_vector_next(&thread->books);
+	if (cix_book_order(book, order, context->session) == false) {
+		fprintf(stderr, "failed to process order\n");
+	}
 
-		if (book == NULL) {
-			fprintf(stderr, "failed to create orderbook\n");
-			goto fail;
+	return;
+}
+
+static void
+cix_market_thread_message(struct cix_market_thread *thread,
+    struct cix_market_context *context)
+{
+	struct cix_market_book_load *load;
+	uint64_t start = cix_market_now(), end;
+
+	switch (context->message.type) {
+	case CIX_MESSAGE_ORDER:
+		cix_market_thread_order(thread, context);
+		break;
+	case CIX_MESSAGE_CANCEL:
+		if (cix_book_cancel(&thread->book_context,
+		    context->message.payload.cancel.internal_id,
+		    context->session) == false) {
+			fprintf(stderr, "failed to process cancel\n");
 		}
 
-		if (cix_book_init(book, symbol, &thread->trade_log) == false) {
-			fprintf(stderr, "failed to initialize orderbook\n");
-			goto fail;
+		break;
+	case CIX_MESSAGE_REPLACE:
+		if (cix_book_replace(&thread->book_context,
+		    &context->message.payload.replace,
+		    context->session) == false) {
+			fprintf(stderr, "failed to process replace\n");
 		}
-	}
 
-	return market;
+		break;
+	default:
+		fprintf(stderr, "unexpected market message type %u\n",
+		    (unsigned int)context->message.type);
+		break;
+	}
 
-fail:
-	for (i = 0; i < market->n_thread; ++i) {
-		cix_market_thread_destroy(&market->threads[i]);
+	/* Reports for the message hold their own references. */
+	cix_session_release(context->session, 1);
+	if (context->entry == NULL) {
+		return;
 	}
 
-	free(market->threads);
-	free(market);
-	return NULL;
+	end = cix_market_now();
+	load = cix_market_entry_load(thread->market, context->entry->index);
+	ck_pr_store_64(&load->messages, load->messages + 1);
+	ck_pr_store_64(&load->nsec, load->nsec + end - start);
+	load->last_active = end;
+	return;
 }
 
-bool
-cix_market_run(struct cix_market *market)
+static void
+cix_market_book_control(struct cix_book *book,
+    enum cix_market_request request)
 {
-	unsigned int i, j;
-
-	for (i = 0; i < market->n_thread; ++i) {
-		struct cix_market_thread *thread = &market->threads[i];
-		int r;
 
-		r = pthread_create(&thread->tid, NULL, cix_market_thread_run,
-		    thread);
-		if (r == 0) {
-			continue;
+	switch (request) {
+	case CIX_MARKET_REQUEST_AUCTION:
+		cix_book_auction(book);
+		break;
+	case CIX_MARKET_REQUEST_UNCROSS:
+		if (cix_book_uncross(book) == false) {
+			fprintf(stderr, "failed to uncross %s\n",
+			    book->symbol.symbol);
 		}
 
-		fprintf(stderr, "failed to start market thread: %s\n",
-		    strerror(r));
+		break;
+	default:
+		fprintf(stderr, "unexpected market request %u\n",
+		    (unsigned int)request);
 		break;
 	}
 
-	if (i == market->n_thread) {
-		return true;
+	return;
+}
+
+/*
+ * No book is in transit while a request for every book is in flight, see
+ * cix_market_control.
+ */
+static void
+cix_market_thread_control(struct cix_market_thread *thread,
+    struct cix_market_context *context)
+{
+	struct cix_book **book;
+
+	if (context->entry != NULL) {
+		struct cix_book *book =
+		    cix_market_thread_book(thread, context->entry);
+
+		if (book != NULL) {
+			cix_market_book_control(book, context->request);
+		}
+
+		return;
 	}
 
-	for (j = 0; j <= i; ++j) {
-		/* XXX: Cancel any threads that have been started */
+	thread->phase = context->request == CIX_MARKET_REQUEST_AUCTION ?
+	    CIX_BOOK_PHASE_AUCTION : CIX_BOOK_PHASE_CONTINUOUS;
+	CIX_VECTOR_FOREACH(book, thread->books) {
+		cix_market_book_control(*book, context->request);
 	}
 
-	return false;
+	ck_pr_dec_uint(&thread->market->broadcasts);
+	return;
 }
 
-bool
-cix_market_order(struct cix_market *market, struct cix_message_order *order,
-    struct cix_session *session)
+static struct cix_market_context *
+cix_market_claim(struct cix_market_thread *thread, bool wait)
 {
-	struct cix_market_thread *thread =
-	    cix_market_symbol_thread(market, &order->symbol);
-	struct cix_market_order_context *context;
+	struct cix_market_context *context;
 
-	context = cix_worq_claim(&thread->queue);
+	context = cix_market_queue_claim(&thread->queue, wait == true ?
+	    CIX_WORQ_CLAIM_BLOCK : CIX_WORQ_CLAIM_NONBLOCK);
 	if (context == NULL) {
 		fprintf(stderr,
-		    "failed to submit order: market queue is full\n");
-		return false;
+		    "failed to submit request: market queue is full\n");
 	}
 
-	context->session = session;
-	memcpy(&context->order, order, sizeof context->order);
+	return context;
+}
 
-	cix_worq_publish(&thread->queue, context);
-	return true;
+/*
+ * Find a pointer in a vector of pointers.
+ */
+static unsigned int
+cix_market_thread_slot(struct cix_vector *vector, const void *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < cix_vector_length(vector); ++i) {
+		if (*(void **)cix_vector_item(vector, i) == p) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Hold a request for a book that is on its way to this thread.  Returns
+ * false if the request can be processed now.  The thread that is giving
+ * the book up sees the new route and processes its requests as usual.
+ */
+static bool
+cix_market_thread_hold(struct cix_market_thread *thread,
+    struct cix_market_context *context)
+{
+	struct cix_market_book *entry = context->entry;
+	struct cix_market_context *held;
+
+	if (entry == NULL ||
+	    context->request >= CIX_MARKET_REQUEST_MIGRATE_OUT ||
+	    ck_pr_load_uint(&entry->arriving) == 0 ||
+	    &thread->market->threads[ck_pr_load_uint(&entry->thread)] !=
+	    thread) {
+		return false;
+	}
+
+	held = cix_vector_next(&thread->held);
+	if (held == NULL) {
+		fprintf(stderr, "!!!failed to hold request for %s!!!\n",
+		    entry->symbol.symbol);
+		exit(EXIT_FAILURE);
+	}
+
+	*held = *context;
+	return true;
+}
+
+/*
+ * Give up a book.  No more requests for it can arrive on this thread, so
+ * its orders are handed to the new owner along with the book.
+ */
+static void
+cix_market_thread_migrate_out(struct cix_market_thread *thread,
+    struct cix_market_context *context)
+{
+	struct cix_market_thread *target =
+	    &thread->market->threads[context->migrate.thread];
+	struct cix_book *book = context->entry->book;
+	struct cix_market_context *handoff;
+	struct cix_vector *orders = NULL;
+
+	/* The book may never have been created, or been reclaimed. */
+	if (book != NULL) {
+		if (cix_book_detach(book, &orders) == false) {
+			fprintf(stderr, "!!!failed to move %s!!!\n",
+			    book->symbol.symbol);
+			exit(EXIT_FAILURE);
+		}
+
+		cix_market_thread_remove(thread,
+		    cix_market_thread_slot(thread->books, book));
+	}
+
+	handoff = cix_market_claim(target, true);
+	handoff->request = CIX_MARKET_REQUEST_MIGRATE_IN;
+	handoff->entry = context->entry;
+	handoff->session = NULL;
+	handoff->migrate.thread = context->migrate.thread;
+	handoff->migrate.orders = orders;
+	cix_market_queue_publish(&target->queue, handoff);
+	return;
+}
+
+/*
+ * Take ownership of a book and then process, in order, everything that was
+ * held for it while it was in transit.
+ */
+static void
+cix_market_thread_migrate_in(struct cix_market_thread *thread,
+    struct cix_market_context *context)
+{
+	struct cix_market_book *entry = context->entry;
+	struct cix_book *book = entry->book;
+	unsigned int i, kept = 0;
+
+	if (context->migrate.orders != NULL) {
+		cix_book_attach(book, &thread->book_context,
+		    context->migrate.orders);
+		if (cix_market_thread_add(thread, book) == false) {
+			fprintf(stderr, "!!!failed to add %s!!!\n",
+			    book->symbol.symbol);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	ck_pr_store_uint(&entry->arriving, 0);
+	for (i = 0; i < cix_vector_length(thread->held); ++i) {
+		struct cix_market_context *held =
+		    cix_vector_item(thread->held, i);
+
+		if (held->entry == entry) {
+			cix_market_thread_dispatch(thread, held);
+		} else {
+			*(struct cix_market_context *)cix_vector_item(
+			    thread->held, kept++) = *held;
+		}
+	}
+
+	while (cix_vector_length(thread->held) > kept) {
+		cix_vector_remove(thread->held,
+		    cix_vector_length(thread->held) - 1);
+	}
+
+	ck_pr_store_uint(&thread->market->migrating, 0);
+	return;
+}
+
+static ck_epoch_record_t *cix_market_epoch_record(struct cix_market *);
+
+static void
+cix_market_book_retire(ck_epoch_entry_t *entry)
+{
+	struct cix_market_orderbook *orderbook =
+	    container_of(entry, struct cix_market_orderbook, retire);
+
+	cix_book_destroy(&orderbook->book);
+	free(orderbook);
+	return;
+}
+
+/*
+ * Take the book at the given slot away from the thread and free it once no
+ * other thread can be reading it.
+ */
+static void
+cix_market_thread_release(struct cix_market_thread *thread,
+    ck_epoch_record_t *record, unsigned int slot)
+{
+	struct cix_book *book =
+	    *(struct cix_book **)cix_vector_item(thread->books, slot);
+	struct cix_market_orderbook *orderbook =
+	    container_of(book, struct cix_market_orderbook, book);
+	struct cix_market_book_load *load;
+
+	cix_market_thread_remove(thread, slot);
+	ck_pr_store_ptr(&cix_market_entry(thread->market, book->index)->book,
+	    NULL);
+
+	/* The rebalancer no longer sees the book, so its rates stop here. */
+	load = cix_market_entry_load(thread->market, book->index);
+	ck_pr_store_64(&load->rate.messages, 0);
+	ck_pr_store_64(&load->rate.nsec, 0);
+
+	ck_epoch_call(record, &orderbook->retire, cix_market_book_retire);
+	return;
+}
+
+/*
+ * Release books that have no resting orders and have not received a
+ * message for the configured idle period.  They are created again on their
+ * next order.
+ */
+static void
+cix_market_thread_reclaim(struct cix_market_thread *thread)
+{
+	struct cix_market *market = thread->market;
+	ck_epoch_record_t *record = cix_market_epoch_record(market);
+	uint64_t now = cix_market_now();
+	unsigned int i = 0;
+
+	if (record == NULL) {
+		return;
+	}
+
+	while (i < cix_vector_length(thread->books)) {
+		struct cix_book *book =
+		    *(struct cix_book **)cix_vector_item(thread->books, i);
+
+		if (now - cix_market_entry_load(market,
+		    book->index)->last_active < market->book_idle ||
+		    book->phase != CIX_BOOK_PHASE_CONTINUOUS ||
+		    cix_book_empty(book) == false) {
+			++i;
+			continue;
+		}
+
+		cix_market_thread_release(thread, record, i);
+	}
+
+	(void)ck_epoch_poll(record);
+	return;
+}
+
+/*
+ * Cancel every order on a delisted symbol's book and release the book.
+ */
+static void
+cix_market_thread_retire(struct cix_market_thread *thread,
+    struct cix_market_book *entry)
+{
+	ck_epoch_record_t *record;
+	struct cix_book *book = entry->book;
+
+	/* The symbol may have been listed again since this was queued. */
+	if (book == NULL || ck_pr_load_uint(&entry->retired) == 0) {
+		return;
+	}
+
+	if (cix_book_clear(book) == false) {
+		fprintf(stderr, "failed to cancel orders for %s\n",
+		    entry->symbol.symbol);
+		return;
+	}
+
+	/* Without a record, the empty book is left for reclaiming. */
+	record = cix_market_epoch_record(thread->market);
+	if (record == NULL) {
+		return;
+	}
+
+	cix_market_thread_release(thread, record,
+	    cix_market_thread_slot(thread->books, book));
+	(void)ck_epoch_poll(record);
+	return;
+}
+
+static void
+cix_market_thread_dispatch(struct cix_market_thread *thread,
+    struct cix_market_context *context)
+{
+
+	switch (context->request) {
+	case CIX_MARKET_REQUEST_MESSAGE:
+		cix_market_thread_message(thread, context);
+		break;
+	case CIX_MARKET_REQUEST_AUCTION:
+	case CIX_MARKET_REQUEST_UNCROSS:
+		cix_market_thread_control(thread, context);
+		break;
+	case CIX_MARKET_REQUEST_MIGRATE_OUT:
+		cix_market_thread_migrate_out(thread, context);
+		break;
+	case CIX_MARKET_REQUEST_MIGRATE_IN:
+		cix_market_thread_migrate_in(thread, context);
+		break;
+	case CIX_MARKET_REQUEST_RECLAIM:
+		cix_market_thread_reclaim(thread);
+		break;
+	case CIX_MARKET_REQUEST_RETIRE:
+		cix_market_thread_retire(thread, context->entry);
+		break;
+	}
+
+	return;
+}
+
+static void cix_market_thread_drain(struct cix_market_thread *);
+
+/*
+ * Process up to the given number of requests from one queue and return
+ * how many there were.
+ */
+static unsigned int
+cix_market_thread_poll(struct cix_market_thread *thread,
+    struct cix_market_queue *queue, unsigned int limit,
+    enum cix_worq_wait wait)
+{
+	struct cix_market_context *context, *first;
+	unsigned int i, n;
+
+	n = cix_market_queue_pop_n(queue, limit, &first, wait);
+	for (i = 0, context = first; i < n; ++i) {
+		if (context->request != CIX_MARKET_REQUEST_MESSAGE) {
+			cix_market_thread_drain(thread);
+		}
+
+		if (cix_market_thread_hold(thread, context) == false) {
+			cix_market_thread_dispatch(thread, context);
+		}
+
+		context = cix_market_queue_next(queue, context);
+	}
+
+	if (n > 0) {
+		cix_market_queue_complete_n(queue, first, n);
+	}
+
+	return n;
+}
+
+/*
+ * Process every message that was published to the lanes before the
+ * current request.  Control requests and book handoffs arrive on the
+ * shared queue, so this keeps them behind whatever sessions sent ahead of
+ * them.  In particular, a thread giving up a book sees every request that
+ * was routed to it along the old route.
+ */
+static void
+cix_market_thread_drain(struct cix_market_thread *thread)
+{
+	unsigned int i;
+
+	for (i = 0; i < thread->market->n_lane; ++i) {
+		struct cix_market_queue *queue = &thread->lanes[i].queue;
+		unsigned int n, left = cix_worq_length(&queue->worq);
+
+		while (left > 0 && (n = cix_market_thread_poll(thread, queue,
+		    left, CIX_WORQ_WAIT_NONBLOCK)) > 0) {
+			left -= n;
+		}
+	}
+
+	return;
+}
+
+/*
+ * Process up to CIX_MARKET_BATCH_SIZE requests from the shared queue and
+ * from each lane, starting with a different lane every time, and return
+ * how many there were.  Reports generated while processing a batch are
+ * queued to their sessions immediately but each session is only woken
+ * once, after the whole batch has been matched.
+ */
+static unsigned int
+cix_market_thread_batch(struct cix_market_thread *thread)
+{
+	unsigned int i, n, n_lane = thread->market->n_lane;
+
+	n = cix_market_thread_poll(thread, &thread->queue,
+	    CIX_MARKET_BATCH_SIZE, CIX_WORQ_WAIT_BLOCK_SLOT);
+	for (i = 0; i < n_lane; ++i) {
+		struct cix_market_lane *lane =
+		    &thread->lanes[(thread->next_lane + i) % n_lane];
+
+		n += cix_market_thread_poll(thread, &lane->queue,
+		    CIX_MARKET_BATCH_SIZE, CIX_WORQ_WAIT_BLOCK_SLOT);
+	}
+
+	if (n_lane > 0) {
+		thread->next_lane = (thread->next_lane + 1) % n_lane;
+	}
+
+	if (n > 0) {
+		cix_session_batch_flush(&thread->batch);
+	}
+
+	return n;
+}
+
+static void
+cix_market_thread_wake(struct cix_market_thread *thread)
+{
+	unsigned int i;
+
+	cix_worq_unpark(&thread->queue.worq);
+	for (i = 0; i < thread->market->n_lane; ++i) {
+		cix_worq_unpark(&thread->lanes[i].queue.worq);
+	}
+
+	return;
+}
+
+/*
+ * Ask producers on every queue to signal the thread's event before it
+ * waits.  Returns false, with the thread awake, if any of the queues got
+ * a request in the meantime.
+ */
+static bool
+cix_market_thread_sleep(struct cix_market_thread *thread)
+{
+	unsigned int i;
+
+	if (cix_worq_park(&thread->queue.worq) == false) {
+		return false;
+	}
+
+	for (i = 0; i < thread->market->n_lane; ++i) {
+		if (cix_worq_park(&thread->lanes[i].queue.worq) == false) {
+			cix_market_thread_wake(thread);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+cix_market_thread_process(struct cix_event *event, cix_event_flags_t flags,
+    void *p)
+{
+	struct cix_market_thread *thread = p;
+
+	(void)event;
+	(void)flags;
+
+	cix_market_thread_wake(thread);
+	do {
+		while (cix_market_thread_batch(thread) > 0);
+	} while (cix_market_thread_sleep(thread) == false);
+
+	return;
+}
+
+static bool
+cix_market_thread_init(struct cix_market *market,
+    struct cix_market_thread *thread, unsigned int index)
+{
+	char trade_log_path[PATH_MAX];
+	struct cix_trade_log_config config = {
+		.path = trade_log_path,
+		.cpu = market->background_cpu
+	};
+	unsigned int i;
+	int b;
+
+	thread->market = market;
+	thread->load = 0;
+	thread->congested = 0;
+	thread->next_lane = 0;
+	thread->phase = CIX_BOOK_PHASE_CONTINUOUS;
+
+	if (cix_vector_init(&thread->books, sizeof(struct cix_book *),
+	    CIX_MARKET_DEFAULT_BOOK_COUNT) == false) {
+		fprintf(stderr, "failed to create orderbooks\n");
+		return false;
+	}
+
+	pthread_mutex_init(&thread->books_lock, NULL);
+
+	if (cix_vector_init(&thread->held,
+	    sizeof(struct cix_market_context), CIX_MARKET_BATCH_SIZE) ==
+	    false) {
+		fprintf(stderr, "failed to create migration buffer\n");
+		return false;
+	}
+
+	b = snprintf(trade_log_path, sizeof trade_log_path,
+	    "/home/brendon/source/cix/logs/%u", index);
+	if (b < 0) {
+		fprintf(stderr, "failed to create trade log path\n");
+		return false;
+	} else if ((unsigned int)b >= sizeof trade_log_path) {
+		fprintf(stderr, "trade log path exceeded maximum length\n");
+		return false;
+	}
+
+	if (cix_trade_log_manager_init(&thread->trade_log, &config) == false) {
+		fprintf(stderr, "failed to initialize trade log\n");
+		return false;
+	}
+
+	if (cix_order_index_init(&thread->orders,
+	    CIX_MARKET_DEFAULT_ORDER_COUNT) == false) {
+		fprintf(stderr, "failed to create market order index\n");
+		return false;
+	}
+
+	if (cix_slab_init(&thread->order_pool, cix_book_order_size,
+	    CIX_MARKET_ORDER_CHUNK_SIZE,
+	    CIX_MARKET_DEFAULT_ORDER_COUNT / CIX_MARKET_ORDER_CHUNK_SIZE) ==
+	    false) {
+		fprintf(stderr, "failed to create market order pool\n");
+		return false;
+	}
+
+	if (cix_slab_init(&thread->order_info_pool, cix_book_order_info_size,
+	    CIX_MARKET_ORDER_CHUNK_SIZE,
+	    CIX_MARKET_DEFAULT_ORDER_COUNT / CIX_MARKET_ORDER_CHUNK_SIZE) ==
+	    false) {
+		fprintf(stderr, "failed to create market order info pool\n");
+		return false;
+	}
+
+	cix_session_batch_init(&thread->batch);
+	thread->book_context.trade_log = &thread->trade_log;
+	thread->book_context.orders = &thread->orders;
+	thread->book_context.pool = &thread->order_pool;
+	thread->book_context.info_pool = &thread->order_info_pool;
+	thread->book_context.batch = &thread->batch;
+
+	if (cix_market_queue_init(&thread->queue, 0) == false) {
+		fprintf(stderr, "failed to create market work queue\n");
+		return false;
+	}
+
+	thread->lanes = calloc(market->n_lane, sizeof *thread->lanes);
+	if (thread->lanes == NULL && market->n_lane > 0) {
+		fprintf(stderr, "failed to create market lanes\n");
+		return false;
+	}
+
+	for (i = 0; i < market->n_lane; ++i) {
+		if (cix_market_queue_init(&thread->lanes[i].queue,
+		    CIX_WORQ_SINGLE_PRODUCER) == false) {
+			fprintf(stderr, "failed to create market lane\n");
+			return false;
+		}
+	}
+
+	if (cix_event_manager_init(&thread->event_manager) == false) {
+		fprintf(stderr, "failed to initialize market event manager\n");
+		return false;
+	}
+
+	if (cix_event_init_managed(&thread->event, cix_market_thread_process,
+	    thread) == false) {
+		fprintf(stderr, "failed to initialize market event listener\n");
+		return false;
+	}
+
+	thread->wait.strategy = CIX_MARKET_WAIT_EVENT;
+	thread->wait.spin = 0;
+
+	/* XXX: cleanup in case of failure */
+	return true;
+}
+
+/*
+ * Connect the queue to whatever the thread will wait on.  Producers only
+ * signal the queue's event if the thread can sleep.
+ */
+static bool
+cix_market_thread_prepare(struct cix_market_thread *thread)
+{
+	unsigned int i;
+
+	if (thread->wait.strategy == CIX_MARKET_WAIT_SPIN) {
+		return true;
+	}
+
+	if (cix_worq_event_subscribe(&thread->queue.worq, &thread->event) ==
+	    false) {
+		fprintf(stderr, "failed to subscribe to market queue\n");
+		return false;
+	}
+
+	for (i = 0; i < thread->market->n_lane; ++i) {
+		if (cix_worq_event_subscribe(&thread->lanes[i].queue.worq,
+		    &thread->event) == false) {
+			fprintf(stderr, "failed to subscribe to market lane\n");
+			return false;
+		}
+	}
+
+	if (thread->wait.strategy == CIX_MARKET_WAIT_EVENT &&
+	    cix_event_add(&thread->event_manager, &thread->event) == false) {
+		fprintf(stderr, "failed to initialize market event loop\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void
+cix_market_thread_destroy(struct cix_market_thread *thread)
+{
+	struct cix_book **book;
+	unsigned int i;
+
+	CIX_VECTOR_FOREACH(book, thread->books) {
+		cix_book_destroy(*book);
+		free(container_of(*book, struct cix_market_orderbook, book));
+	}
+
+	free(thread->books);
+	pthread_mutex_destroy(&thread->books_lock);
+	free(thread->held);
+	cix_order_index_destroy(&thread->orders);
+	cix_slab_destroy(&thread->order_pool);
+	cix_slab_destroy(&thread->order_info_pool);
+	cix_worq_destroy(&thread->queue.worq);
+	for (i = 0; i < thread->market->n_lane; ++i) {
+		cix_worq_destroy(&thread->lanes[i].queue.worq);
+	}
+
+	free(thread->lanes);
+	return;
+}
+
+static uint32_t
+cix_market_symbol_hash(const cix_symbol_t *symbol)
+{
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	/* FNV-1a */
+	for (i = 0; i < sizeof symbol->symbol && symbol->symbol[i] != '\0';
+	    ++i) {
+		hash ^= (unsigned char)symbol->symbol[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+ * Symbols are initially partitioned across threads by hash.
+ */
+static struct cix_market_thread *
+cix_market_symbol_thread(struct cix_market *market, const cix_symbol_t *symbol)
+{
+
+	return &market->threads[cix_market_symbol_hash(symbol) %
+	    market->n_thread];
+}
+
+/*
+ * Find a symbol's entry, whether or not it is currently listed.  Entries
+ * are never freed, so the result remains valid after the directory has
+ * been replaced.
+ */
+static struct cix_market_book *
+cix_market_lookup(struct cix_market *market, const cix_symbol_t *symbol)
+{
+	ck_epoch_record_t *record = cix_market_epoch_record(market);
+	struct cix_market_directory *directory;
+	struct cix_market_book *entry = NULL;
+	ck_epoch_section_t section;
+	uint32_t i;
+
+	if (record == NULL) {
+		return NULL;
+	}
+
+	ck_epoch_begin(record, &section);
+	directory = ck_pr_load_ptr(&market->directory);
+	for (i = cix_market_symbol_hash(symbol) & directory->mask;;
+	    i = (i + 1) & directory->mask) {
+		unsigned int index = ck_pr_load_uint(&directory->slots[i]);
+
+		if (index == CIX_MARKET_SYMBOL_EMPTY) {
+			break;
+		}
+
+		if (strncmp(cix_market_entry(market, index)->symbol.symbol,
+		    symbol->symbol, sizeof symbol->symbol) == 0) {
+			entry = cix_market_entry(market, index);
+			break;
+		}
+	}
+
+	ck_epoch_end(record, &section);
+	return entry;
+}
+
+static struct cix_market_directory *
+cix_market_directory_create(unsigned int n_slot)
+{
+	struct cix_market_directory *directory;
+	unsigned int i;
+
+	directory = malloc(sizeof *directory + n_slot *
+	    sizeof *directory->slots);
+	if (directory == NULL) {
+		fprintf(stderr, "failed to create symbol directory\n");
+		return NULL;
+	}
+
+	directory->mask = n_slot - 1;
+	directory->count = 0;
+	for (i = 0; i < n_slot; ++i) {
+		directory->slots[i] = CIX_MARKET_SYMBOL_EMPTY;
+	}
+
+	return directory;
+}
+
+static void
+cix_market_directory_insert(struct cix_market *market,
+    struct cix_market_directory *directory, unsigned int index)
+{
+	uint32_t i = cix_market_symbol_hash(
+	    &cix_market_entry(market, index)->symbol) & directory->mask;
+
+	while (directory->slots[i] != CIX_MARKET_SYMBOL_EMPTY) {
+		i = (i + 1) & directory->mask;
+	}
+
+	/* The entry must be visible before sessions can find it. */
+	ck_pr_fence_store();
+	ck_pr_store_uint(&directory->slots[i], index);
+	directory->count++;
+	return;
+}
+
+/*
+ * Add a symbol to the market, or restore a delisted one.  Callers must
+ * hold the listing lock, except while the market is being created.
+ */
+static bool
+cix_market_list(struct cix_market *market, const cix_symbol_t *symbol)
+{
+	struct cix_market_directory *directory = market->directory;
+	struct cix_market_directory *grown = NULL;
+	struct cix_market_book *entry;
+	ck_epoch_record_t *record = NULL;
+	unsigned int i, index = market->n_book;
+
+	entry = cix_market_lookup(market, symbol);
+	if (entry != NULL) {
+		if (ck_pr_load_uint(&entry->retired) == 0) {
+			fprintf(stderr, "duplicate symbol %.*s\n",
+			    (int)sizeof symbol->symbol, symbol->symbol);
+			return false;
+		}
+
+		ck_pr_store_uint(&entry->retired, 0);
+		return true;
+	}
+
+	if (index > CIX_BOOK_MAX_INDEX) {
+		fprintf(stderr, "too many symbols to add %.*s\n",
+		    (int)sizeof symbol->symbol, symbol->symbol);
+		return false;
+	}
+
+	/* Keep the directory at most half full. */
+	if (2 * (directory->count + 1) > directory->mask + 1) {
+		record = cix_market_epoch_record(market);
+		if (record == NULL) {
+			return false;
+		}
+
+		grown = cix_market_directory_create(2 * (directory->mask + 1));
+		if (grown == NULL) {
+			return false;
+		}
+	}
+
+	if ((index & CIX_MARKET_CHUNK_MASK) == 0) {
+		struct cix_market_chunk *chunk;
+
+		/* Anonymous mappings are zeroed without being touched. */
+		chunk = mmap(NULL, sizeof *chunk, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED) {
+			fprintf(stderr, "failed to allocate symbols\n");
+			free(grown);
+			return false;
+		}
+
+		ck_pr_store_ptr(
+		    &market->chunks[index >> CIX_MARKET_CHUNK_SHIFT], chunk);
+	}
+
+	entry = cix_market_entry(market, index);
+	memset(&entry->symbol, 0, sizeof entry->symbol);
+	strncpy(entry->symbol.symbol, symbol->symbol,
+	    sizeof entry->symbol.symbol);
+	entry->book = NULL;
+	entry->index = index;
+	entry->thread = cix_market_symbol_thread(market, symbol) -
+	    market->threads;
+	entry->retired = 0;
+	entry->arriving = 0;
+	ck_pr_fence_store();
+	ck_pr_store_uint(&market->n_book, index + 1);
+
+	if (grown == NULL) {
+		cix_market_directory_insert(market, directory, index);
+		return true;
+	}
+
+	for (i = 0; i <= directory->mask; ++i) {
+		if (directory->slots[i] != CIX_MARKET_SYMBOL_EMPTY) {
+			cix_market_directory_insert(market, grown,
+			    directory->slots[i]);
+		}
+	}
+
+	cix_market_directory_insert(market, grown, index);
+	ck_pr_store_ptr(&market->directory, grown);
+	ck_epoch_synchronize(record);
+	free(directory);
+	return true;
+}
+
+/*
+ * Find the book that issued an order ID, or NULL if there is none.
+ */
+static struct cix_market_book *
+cix_market_order_book(struct cix_market *market, cix_order_id_t id)
+{
+	uint64_t index = CIX_BOOK_ID_INDEX(id);
+
+	return index < ck_pr_load_uint(&market->n_book) ?
+	    cix_market_entry(market, index) : NULL;
+}
+
+/*
+ * Each thread that queues requests gets its own epoch record the first
+ * time it does so.
+ * XXX: This assumes a single market per process.
+ */
+static __thread ck_epoch_record_t *cix_market_record;
+
+static ck_epoch_record_t *
+cix_market_epoch_record(struct cix_market *market)
+{
+	ck_epoch_record_t *record = cix_market_record;
+
+	if (record != NULL) {
+		return record;
+	}
+
+	record = ck_epoch_recycle(&market->epoch, NULL);
+	if (record == NULL) {
+		record = malloc(sizeof *record);
+		if (record == NULL) {
+			fprintf(stderr, "failed to allocate epoch record\n");
+			return NULL;
+		}
+
+		ck_epoch_register(&market->epoch, record, NULL);
+	}
+
+	cix_market_record = record;
+	return record;
+}
+
+static void
+cix_market_thread_spin(struct cix_market_thread *thread)
+{
+
+	for (;;) {
+		if (cix_market_thread_batch(thread) == 0) {
+			ck_pr_stall();
+		}
+	}
+
+	return;
+}
+
+/*
+ * Producers stay quiet while the thread polls.  Once it has given up
+ * polling, any request published after the queues were last found empty
+ * either keeps the thread from sleeping or signals the event, so the
+ * wait returns immediately and nothing is missed.
+ */
+static void
+cix_market_thread_park(struct cix_market_thread *thread)
+{
+	unsigned int idle = 0;
+
+	cix_market_thread_wake(thread);
+	for (;;) {
+		if (cix_market_thread_batch(thread) > 0) {
+			idle = 0;
+		} else if (++idle < thread->wait.spin) {
+			ck_pr_stall();
+		} else {
+			if (cix_market_thread_sleep(thread) == true &&
+			    cix_event_managed_wait(&thread->event) == false) {
+				return;
+			}
+
+			cix_market_thread_wake(thread);
+			idle = 0;
+		}
+	}
+
+	return;
+}
+
+static void *
+cix_market_thread_run(void *p)
+{
+	struct cix_market_thread *thread = p;
+
+	switch (thread->wait.strategy) {
+	case CIX_MARKET_WAIT_EVENT:
+		cix_event_manager_run(&thread->event_manager);
+		break;
+	case CIX_MARKET_WAIT_SPIN:
+		cix_market_thread_spin(thread);
+		break;
+	case CIX_MARKET_WAIT_PARK:
+		cix_market_thread_park(thread);
+		break;
+	}
+
+	fprintf(stderr, "market thread exited\n");
+	return NULL;
+}
+
+/*
+ * Move a book to another thread without reordering its requests:
+ * 1. Mark the book as arriving, so that the target holds its requests.
+ * 2. Route new requests for the book to the target.
+ * 3. Wait until every request routed the old way has been queued.
+ * 4. Tell the current owner to hand the book over.  It processes what is
+ *    left in its lanes first and will not see any more requests for it
+ *    after this.
+ */
+static void
+cix_market_migrate(struct cix_market *market, struct cix_market_book *entry,
+    unsigned int target)
+{
+	struct cix_market_thread *source = &market->threads[entry->thread];
+	struct cix_market_context *context;
+	ck_epoch_record_t *record = cix_market_epoch_record(market);
+
+	if (record == NULL) {
+		return;
+	}
+
+	/* Back off if a request for every book has started meanwhile. */
+	ck_pr_store_uint(&market->migrating, 1);
+	ck_pr_fence_memory();
+	if (ck_pr_load_uint(&market->broadcasts) != 0) {
+		ck_pr_store_uint(&market->migrating, 0);
+		return;
+	}
+
+	ck_pr_store_uint(&entry->arriving, 1);
+	ck_pr_fence_store();
+	ck_pr_store_uint(&entry->thread, target);
+	ck_epoch_synchronize(record);
+
+	context = cix_market_claim(source, true);
+	context->request = CIX_MARKET_REQUEST_MIGRATE_OUT;
+	context->entry = entry;
+	context->session = NULL;
+	context->migrate.thread = target;
+	cix_market_queue_publish(&source->queue, context);
+	return;
+}
+
+/*
+ * Update a loaded book's rates from the last interval and return its
+ * processing time per second.
+ */
+static uint64_t
+cix_market_book_rate(struct cix_market *market, unsigned int index,
+    uint64_t elapsed)
+{
+	struct cix_market_book_load *load =
+	    cix_market_entry_load(market, index);
+	uint64_t messages = ck_pr_load_64(&load->messages);
+	uint64_t nsec = ck_pr_load_64(&load->nsec);
+
+	ck_pr_store_64(&load->rate.messages,
+	    (messages - load->last_messages) * 1000000000 / elapsed);
+	ck_pr_store_64(&load->rate.nsec,
+	    (nsec - load->last_nsec) * 1000000000 / elapsed);
+	load->last_messages = messages;
+	load->last_nsec = nsec;
+	return load->rate.nsec;
+}
+
+/*
+ * Update per-book rates from the last interval and move the book that
+ * best evens out the busiest and idlest threads.  Only books that are
+ * loaded on some thread can have done any work, so symbols that are not
+ * trading cost nothing here.
+ */
+static void
+cix_market_rebalance(struct cix_market *market, uint64_t elapsed)
+{
+	struct cix_market_thread *hot, *cold;
+	struct cix_market_book *move = NULL;
+	struct cix_book **book;
+	uint64_t gap, best = 0;
+	unsigned int i;
+
+	if (elapsed == 0) {
+		return;
+	}
+
+	for (i = 0; i < market->n_thread; ++i) {
+		struct cix_market_thread *thread = &market->threads[i];
+
+		thread->load = 0;
+		pthread_mutex_lock(&thread->books_lock);
+		CIX_VECTOR_FOREACH(book, thread->books) {
+			thread->load += cix_market_book_rate(market,
+			    (*book)->index, elapsed);
+		}
+
+		pthread_mutex_unlock(&thread->books_lock);
+	}
+
+	if (ck_pr_load_uint(&market->migrating) != 0 ||
+	    ck_pr_load_uint(&market->broadcasts) != 0) {
+		return;
+	}
+
+	hot = cold = &market->threads[0];
+	for (i = 1; i < market->n_thread; ++i) {
+		if (market->threads[i].load > hot->load) {
+			hot = &market->threads[i];
+		}
+
+		if (market->threads[i].load < cold->load) {
+			cold = &market->threads[i];
+		}
+	}
+
+	if (hot->load - cold->load < CIX_MARKET_REBALANCE_THRESHOLD) {
+		return;
+	}
+
+	/*
+	 * Moving more than half of the difference would only make the idle
+	 * thread the busy one.
+	 */
+	gap = (hot->load - cold->load) / 2;
+	pthread_mutex_lock(&hot->books_lock);
+	CIX_VECTOR_FOREACH(book, hot->books) {
+		uint64_t nsec =
+		    cix_market_entry_load(market, (*book)->index)->rate.nsec;
+
+		if (nsec > best && nsec <= gap) {
+			move = cix_market_entry(market, (*book)->index);
+			best = nsec;
+		}
+	}
+
+	pthread_mutex_unlock(&hot->books_lock);
+	if (move != NULL) {
+		cix_market_migrate(market, move, cold - market->threads);
+	}
+
+	return;
+}
+
+static bool cix_market_control_thread(struct cix_market_thread *,
+    enum cix_market_request, struct cix_market_book *);
+
+/*
+ * Rebalance books between threads and ask each thread to reclaim its idle
+ * books.
+ */
+static void *
+cix_market_background_run(void *p)
+{
+	struct cix_market *market = p;
+	struct timespec interval = {
+		.tv_sec = CIX_MARKET_REBALANCE_INTERVAL_MS / 1000,
+		.tv_nsec = (CIX_MARKET_REBALANCE_INTERVAL_MS % 1000) * 1000000
+	};
+	uint64_t last = cix_market_now(), last_reclaim = last;
+	unsigned int i;
+
+	for (;;) {
+		uint64_t now;
+
+		nanosleep(&interval, NULL);
+		now = cix_market_now();
+		if (market->n_thread > 1) {
+			cix_market_rebalance(market, now - last);
+		}
+
+		last = now;
+		if (market->book_idle == 0 || now - last_reclaim <
+		    CIX_MARKET_RECLAIM_INTERVAL_MS * 1000000ULL) {
+			continue;
+		}
+
+		for (i = 0; i < market->n_thread; ++i) {
+			(void)cix_market_control_thread(&market->threads[i],
+			    CIX_MARKET_REQUEST_RECLAIM, NULL);
+		}
+
+		last_reclaim = now;
+	}
+
+	return NULL;
+}
+
+/*
+ * Set up a market thread.  This runs on the thread's CPU so that everything
+ * it allocates is local to that CPU.  Its books are created later by the
+ * thread itself.
+ */
+static void *
+cix_market_thread_setup(void *p)
+{
+	struct cix_market_thread *thread = p;
+	struct cix_market *market = thread->market;
+
+	if (cix_market_thread_init(market, thread, thread - market->threads) ==
+	    false) {
+		return NULL;
+	}
+
+	return thread;
+}
+
+struct cix_market *
+cix_market_init(struct cix_vector *symbols,
+    const struct cix_market_config *config)
+{
+	struct cix_market *market = malloc(sizeof *market);
+	unsigned int i, n_init = 0, n_slot;
+	cix_symbol_t *symbol;
+
+	if (market == NULL) {
+		fprintf(stderr, "failed to create market\n");
+		return NULL;
+	}
+
+	if (config->n_thread == 0) {
+		fprintf(stderr, "market requires at least one thread\n");
+		free(market);
+		return NULL;
+	}
+
+	/* Keep the symbol table at most half full. */
+	for (n_slot = 16; n_slot < 2 * cix_vector_length(symbols);
+	    n_slot <<= 1);
+
+	market->n_thread = config->n_thread;
+	market->n_lane = config->n_lane;
+	market->background_cpu = config->background_cpu;
+	market->book_idle = config->book_idle_sec * 1000000000ULL;
+	market->n_book = 0;
+	market->migrating = 0;
+	market->broadcasts = 0;
+	ck_epoch_init(&market->epoch);
+	pthread_mutex_init(&market->listing, NULL);
+	market->threads = malloc(market->n_thread * sizeof(*market->threads));
+	market->chunks = calloc(CIX_MARKET_CHUNK_COUNT,
+	    sizeof *market->chunks);
+	market->directory = cix_market_directory_create(n_slot);
+	if (market->threads == NULL || market->chunks == NULL ||
+	    market->directory == NULL) {
+		fprintf(stderr, "failed to create market threads\n");
+		goto fail;
+	}
+
+	CIX_VECTOR_FOREACH(symbol, symbols) {
+		if (cix_market_list(market, symbol) == false) {
+			goto fail;
+		}
+	}
+
+	for (n_init = 0; n_init < market->n_thread; ++n_init) {
+		struct cix_market_thread *thread = &market->threads[n_init];
+		void *result = NULL;
+
+		thread->market = market;
+		thread->cpu = config->cpu != NULL ? config->cpu[n_init] :
+		    CIX_THREAD_CPU_ANY;
+		if (cix_thread_call(thread->cpu, cix_market_thread_setup,
+		    thread, &result) == false || result == NULL) {
+			fprintf(stderr, "failed to initialize market thread\n");
+			goto fail;
+		}
+	}
+
+	return market;
+
+fail:
+	for (i = 0; i < n_init; ++i) {
+		cix_market_thread_destroy(&market->threads[i]);
+	}
+
+	if (market->chunks != NULL) {
+		for (i = 0; i < CIX_MARKET_CHUNK_COUNT; ++i) {
+			if (market->chunks[i] != NULL) {
+				munmap(market->chunks[i],
+				    sizeof *market->chunks[i]);
+			}
+		}
+	}
+
+	free(market->chunks);
+	free(market->directory);
+	free(market->threads);
+	free(market);
+	return NULL;
+}
+
+bool
+cix_market_run(struct cix_market *market)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < market->n_thread; ++i) {
+		struct cix_market_thread *thread = &market->threads[i];
+
+		if (cix_market_thread_prepare(thread) == false) {
+			break;
+		}
+
+		if (cix_thread_create(&thread->tid, thread->cpu,
+		    cix_market_thread_run, thread) == false) {
+			fprintf(stderr, "failed to start market thread\n");
+			break;
+		}
+	}
+
+	if (i < market->n_thread) {
+		for (j = 0; j <= i; ++j) {
+			/* XXX: Cancel any threads that have been started */
+		}
+
+		return false;
+	}
+
+	if (market->n_thread == 1 && market->book_idle == 0) {
+		return true;
+	}
+
+	if (cix_thread_create(&market->background, market->background_cpu,
+	    cix_market_background_run, market) == false) {
+		fprintf(stderr, "failed to start market background thread\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+cix_market_thread_wait(struct cix_market *market, unsigned int index,
+    const struct cix_market_wait *wait)
+{
+
+	if (index >= market->n_thread) {
+		fprintf(stderr, "no market thread %u\n", index);
+		return false;
+	}
+
+	switch (wait->strategy) {
+	case CIX_MARKET_WAIT_EVENT:
+	case CIX_MARKET_WAIT_SPIN:
+	case CIX_MARKET_WAIT_PARK:
+		break;
+	default:
+		fprintf(stderr, "unknown market wait strategy %u\n",
+		    (unsigned int)wait->strategy);
+		return false;
+	}
+
+	market->threads[index].wait = *wait;
+	return true;
+}
+
+/*
+ * Check whether a queue is backed up, with hysteresis between the high and
+ * low-water marks.  Producers race to update the flag, but every one of
+ * them sets it to the same value for a given queue length.
+ */
+static bool
+cix_market_congested(struct cix_market_queue *queue,
+    unsigned int *congested)
+{
+	unsigned int length = cix_worq_length(&queue->worq);
+
+	if (ck_pr_load_uint(congested) == 0) {
+		if (length < CIX_MARKET_HIGH_WATER) {
+			return false;
+		}
+
+		ck_pr_store_uint(congested, 1);
+		return true;
+	}
+
+	if (length > CIX_MARKET_LOW_WATER) {
+		return true;
+	}
+
+	ck_pr_store_uint(congested, 0);
+	return false;
+}
+
+/*
+ * Find the book that a message applies to.  Returns false if the message
+ * cannot be queued at all.  Cancels and replaces do not carry a symbol, so
+ * they are routed by the book index embedded in the order ID.  Unknown IDs
+ * have no book and are sent to the first thread, which will report them
+ * as errors.
+ */
+static bool
+cix_market_route(struct cix_market *market, const struct cix_message *message,
+    struct cix_market_book **book)
+{
+
+	switch (message->type) {
+	case CIX_MESSAGE_ORDER:
+		*book = cix_market_lookup(market,
+		    &message->payload.order.symbol);
+		return *book != NULL &&
+		    ck_pr_load_uint(&(*book)->retired) == 0;
+	case CIX_MESSAGE_CANCEL:
+		*book = cix_market_order_book(market,
+		    message->payload.cancel.internal_id);
+		return true;
+	case CIX_MESSAGE_REPLACE:
+		*book = cix_market_order_book(market,
+		    message->payload.replace.internal_id);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void
+cix_market_reject(const struct cix_message *message,
+    struct cix_session *session)
+{
+
+	if (message->type != CIX_MESSAGE_ORDER) {
+		fprintf(stderr, "unexpected message type %u\n",
+		    (unsigned int)message->type);
+		return;
+	}
+
+	if (cix_session_reject(session,
+	    message->payload.order.external_id) == false) {
+		fprintf(stderr, "failed to reject order\n");
+	}
+
+	return;
+}
+
+/*
+ * Queue messages for up to one batch.  Routes are found up front, but
+ * nothing is sent for a message until every message before it has been
+ * queued, so that a busy thread leaves the rest untouched for the caller
+ * to resubmit.
+ */
+static enum cix_market_status
+cix_market_submit(struct cix_market *market, unsigned int lane,
+    const struct cix_message *messages, unsigned int n,
+    struct cix_session *session, unsigned int *consumed)
+{
+	struct cix_market_book *books[CIX_MARKET_BATCH_SIZE];
+	bool routed[CIX_MARKET_BATCH_SIZE];
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		routed[i] = cix_market_route(market, &messages[i], &books[i]);
+	}
+
+	i = 0;
+	while (i < n) {
+		struct cix_market_thread *thread;
+		struct cix_market_context *context, *first;
+		struct cix_market_queue *queue;
+		unsigned int run, claimed, j, *congested;
+
+		if (routed[i] == false) {
+			cix_market_reject(&messages[i], session);
+			++i;
+			continue;
+		}
+
+		thread = &market->threads[books[i] != NULL ?
+		    ck_pr_load_uint(&books[i]->thread) : 0];
+		for (run = 1; i + run < n && routed[i + run] == true; ++run) {
+			struct cix_market_book *book = books[i + run];
+
+			if (&market->threads[book != NULL ?
+			    ck_pr_load_uint(&book->thread) : 0] != thread) {
+				break;
+			}
+		}
+
+		if (lane < market->n_lane) {
+			queue = &thread->lanes[lane].queue;
+			congested = &thread->lanes[lane].congested;
+		} else {
+			queue = &thread->queue;
+			congested = &thread->congested;
+		}
+
+		if (cix_market_congested(queue, congested) == true) {
+			break;
+		}
+
+		claimed = cix_market_queue_claim_n(queue, run, &first,
+		    CIX_WORQ_CLAIM_NONBLOCK);
+		for (j = 0, context = first; j < claimed; ++j) {
+			const struct cix_message *message = &messages[i + j];
+
+			context->request = CIX_MARKET_REQUEST_MESSAGE;
+			context->entry = books[i + j];
+			context->session = session;
+			context->message.type = message->type;
+			memcpy(&context->message.payload, &message->payload,
+			    cix_message_length(message->type));
+			context = cix_market_queue_next(queue, context);
+		}
+
+		if (claimed > 0) {
+			cix_session_hold(session, claimed);
+		}
+
+		cix_market_queue_publish_n(queue, first, claimed);
+		i += claimed;
+		if (claimed < run) {
+			break;
+		}
+	}
+
+	*consumed = i;
+	return i == n ? CIX_MARKET_OK : CIX_MARKET_BUSY;
+}
+
+enum cix_market_status
+cix_market_messages(struct cix_market *market, unsigned int lane,
+    const struct cix_message *messages, unsigned int n,
+    struct cix_session *session, unsigned int *consumed)
+{
+	ck_epoch_record_t *record = cix_market_epoch_record(market);
+	enum cix_market_status status = CIX_MARKET_OK;
+	ck_epoch_section_t section;
+
+	*consumed = 0;
+	if (record == NULL) {
+		return CIX_MARKET_ERROR;
+	}
+
+	ck_epoch_begin(record, &section);
+	while (*consumed < n && status == CIX_MARKET_OK) {
+		unsigned int batch = min(n - *consumed, CIX_MARKET_BATCH_SIZE);
+		unsigned int done;
+
+		status = cix_market_submit(market, lane, messages + *consumed,
+		    batch, session, &done);
+		*consumed += done;
+	}
+
+	ck_epoch_end(record, &section);
+	return status;
+}
+
+static bool
+cix_market_control_thread(struct cix_market_thread *thread,
+    enum cix_market_request request, struct cix_market_book *entry)
+{
+	struct cix_market_context *context;
+
+	context = cix_market_claim(thread, false);
+	if (context == NULL) {
+		return false;
+	}
+
+	context->request = request;
+	context->entry = entry;
+	context->session = NULL;
+	cix_market_queue_publish(&thread->queue, context);
+	return true;
+}
+
+/*
+ * Queue a control request on the thread that currently owns a symbol.
+ */
+static bool
+cix_market_control_entry(struct cix_market *market,
+    enum cix_market_request request, struct cix_market_book *entry)
+{
+	ck_epoch_record_t *record = cix_market_epoch_record(market);
+	ck_epoch_section_t section;
+	bool result;
+
+	if (record == NULL) {
+		return false;
+	}
+
+	ck_epoch_begin(record, &section);
+	result = cix_market_control_thread(
+	    &market->threads[ck_pr_load_uint(&entry->thread)], request, entry);
+	ck_epoch_end(record, &section);
+	return result;
+}
+
+/*
+ * Queue a control request for one symbol, or for every book on every
+ * thread if no symbol is given.  A book that is moving between threads
+ * would miss the latter, so it first waits for any move under way to
+ * finish, and no book is moved until every thread has applied it.
+ */
+static bool
+cix_market_control(struct cix_market *market, enum cix_market_request request,
+    const cix_symbol_t *symbol)
+{
+	struct cix_market_book *book;
+	unsigned int i;
+
+	if (symbol == NULL) {
+		ck_pr_add_uint(&market->broadcasts, market->n_thread);
+		ck_pr_fence_memory();
+		while (ck_pr_load_uint(&market->migrating) != 0) {
+			ck_pr_stall();
+		}
+
+		for (i = 0; i < market->n_thread; ++i) {
+			if (cix_market_control_thread(&market->threads[i],
+			    request, NULL) == false) {
+				ck_pr_sub_uint(&market->broadcasts,
+				    market->n_thread - i);
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	book = cix_market_lookup(market, symbol);
+	if (book == NULL) {
+		fprintf(stderr, "unknown symbol %.*s\n",
+		    (int)sizeof symbol->symbol, symbol->symbol);
+		return false;
+	}
+
+	return cix_market_control_entry(market, request, book);
+}
+
+bool
+cix_market_auction(struct cix_market *market, const cix_symbol_t *symbol)
+{
+
+	return cix_market_control(market, CIX_MARKET_REQUEST_AUCTION, symbol);
+}
+
+bool
+cix_market_uncross(struct cix_market *market, const cix_symbol_t *symbol)
+{
+
+	return cix_market_control(market, CIX_MARKET_REQUEST_UNCROSS, symbol);
+}
+
+bool
+cix_market_order_pool_stats(struct cix_market *market, unsigned int index,
+    struct cix_slab_stats *orders, struct cix_slab_stats *info)
+{
+
+	if (index >= market->n_thread) {
+		return false;
+	}
+
+	cix_slab_stats(&market->threads[index].order_pool, orders);
+	cix_slab_stats(&market->threads[index].order_info_pool, info);
+	return true;
+}
+
+bool
+cix_market_bbo(struct cix_market *market, const cix_symbol_t *symbol,
+    struct cix_book_bbo *bbo)
+{
+	struct cix_market_book *entry = cix_market_lookup(market, symbol);
+	ck_epoch_record_t *record = cix_market_epoch_record(market);
+	ck_epoch_section_t section;
+	struct cix_book *book;
+
+	if (entry == NULL || record == NULL) {
+		return false;
+	}
+
+	/* Books are only created once their symbol receives an order. */
+	ck_epoch_begin(record, &section);
+	book = ck_pr_load_ptr(&entry->book);
+	if (book != NULL) {
+		cix_book_bbo(book, bbo);
+	} else {
+		memset(bbo, 0, sizeof *bbo);
+	}
+
+	ck_epoch_end(record, &section);
+	return true;
+}
+
+bool
+cix_market_symbol_load(struct cix_market *market, const cix_symbol_t *symbol,
+    struct cix_market_load *load)
+{
+	struct cix_market_book *book = cix_market_lookup(market, symbol);
+	struct cix_market_book_load *source;
+
+	if (book == NULL) {
+		return false;
+	}
+
+	source = cix_market_entry_load(market, book->index);
+	load->messages = ck_pr_load_64(&source->rate.messages);
+	load->nsec = ck_pr_load_64(&source->rate.nsec);
+	load->thread = ck_pr_load_uint(&book->thread);
+	return true;
+}
+
+bool
+cix_market_symbol_add(struct cix_market *market, const cix_symbol_t *symbol)
+{
+	bool result;
+
+	pthread_mutex_lock(&market->listing);
+	result = cix_market_list(market, symbol);
+	pthread_mutex_unlock(&market->listing);
+	return result;
+}
+
+bool
+cix_market_symbol_retire(struct cix_market *market,
+    const cix_symbol_t *symbol)
+{
+	struct cix_market_book *book;
+	bool result = false;
+
+	pthread_mutex_lock(&market->listing);
+	book = cix_market_lookup(market, symbol);
+	if (book == NULL || ck_pr_load_uint(&book->retired) != 0) {
+		fprintf(stderr, "symbol %.*s is not listed\n",
+		    (int)sizeof symbol->symbol, symbol->symbol);
+		goto done;
+	}
+
+	ck_pr_store_uint(&book->retired, 1);
+	result = cix_market_control_entry(market, CIX_MARKET_REQUEST_RETIRE,
+	    book);
+	if (result == false) {
+		fprintf(stderr, "failed to delist %.*s\n",
+		    (int)sizeof symbol->symbol, symbol->symbol);
+		ck_pr_store_uint(&book->retired, 0);
+	}
+
+done:
+	pthread_mutex_unlock(&market->listing);
+	return result;
 }
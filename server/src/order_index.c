@@ -0,0 +1,156 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "order_index.h"
+
+/* Resize once the table is more than half full */
+#define CIX_ORDER_INDEX_FULL(I)	((I)->n_entries >= (((I)->mask + 1) >> 1))
+
+static inline uint64_t
+cix_order_index_hash(const struct cix_order_index *index, cix_order_id_t id)
+{
+	uint64_t h = id * UINT64_C(0x9E3779B97F4A7C15);
+
+	return (h ^ (h >> 32)) & index->mask;
+}
+
+bool
+cix_order_index_init(struct cix_order_index *index, size_t size)
+{
+
+	assert(size > 0 && (size & (size - 1)) == 0);
+
+	index->entries = calloc(size, sizeof *index->entries);
+	if (index->entries == NULL) {
+		fprintf(stderr, "failed to allocate order index\n");
+		return false;
+	}
+
+	index->mask = size - 1;
+	index->n_entries = 0;
+	return true;
+}
+
+void
+cix_order_index_destroy(struct cix_order_index *index)
+{
+
+	free(index->entries);
+	index->entries = NULL;
+	return;
+}
+
+static void
+cix_order_index_place(struct cix_order_index *index, cix_order_id_t id,
+    struct cix_order *order)
+{
+	uint64_t i;
+
+	for (i = cix_order_index_hash(index, id);
+	    index->entries[i].order != NULL; i = (i + 1) & index->mask);
+
+	index->entries[i].id = id;
+	index->entries[i].order = order;
+	return;
+}
+
+static bool
+cix_order_index_grow(struct cix_order_index *index)
+{
+	struct cix_order_index_entry *old = index->entries;
+	uint64_t old_size = index->mask + 1;
+	uint64_t i;
+
+	index->entries = calloc(old_size << 1, sizeof *index->entries);
+	if (index->entries == NULL) {
+		index->entries = old;
+		return false;
+	}
+
+	index->mask = (old_size << 1) - 1;
+	for (i = 0; i < old_size; ++i) {
+		if (old[i].order != NULL) {
+			cix_order_index_place(index, old[i].id, old[i].order);
+		}
+	}
+
+	free(old);
+	return true;
+}
+
+bool
+cix_order_index_insert(struct cix_order_index *index, cix_order_id_t id,
+    struct cix_order *order)
+{
+
+	assert(order != NULL);
+
+	if (CIX_ORDER_INDEX_FULL(index) &&
+	    cix_order_index_grow(index) == false) {
+		fprintf(stderr, "failed to grow order index\n");
+		return false;
+	}
+
+	cix_order_index_place(index, id, order);
+	++index->n_entries;
+	return true;
+}
+
+struct cix_order *
+cix_order_index_find(const struct cix_order_index *index, cix_order_id_t id)
+{
+	uint64_t i;
+
+	for (i = cix_order_index_hash(index, id);
+	    index->entries[i].order != NULL; i = (i + 1) & index->mask) {
+		if (index->entries[i].id == id) {
+			return index->entries[i].order;
+		}
+	}
+
+	return NULL;
+}
+
+struct cix_order *
+cix_order_index_remove(struct cix_order_index *index, cix_order_id_t id)
+{
+	struct cix_order *order;
+	uint64_t i, j;
+
+	for (i = cix_order_index_hash(index, id);
+	    index->entries[i].order != NULL; i = (i + 1) & index->mask) {
+		if (index->entries[i].id == id) {
+			break;
+		}
+	}
+
+	order = index->entries[i].order;
+	if (order == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * Shift back any following entries in the probe sequence that would
+	 * otherwise become unreachable once this slot is cleared.
+	 */
+	for (j = (i + 1) & index->mask; index->entries[j].order != NULL;
+	    j = (j + 1) & index->mask) {
+		uint64_t home = cix_order_index_hash(index,
+		    index->entries[j].id);
+
+		/* Entry can stay if its home lies cyclically in (i, j] */
+		if (((j - home) & index->mask) < ((j - i) & index->mask)) {
+			continue;
+		}
+
+		index->entries[i] = index->entries[j];
+		i = j;
+	}
+
+	index->entries[i].order = NULL;
+	--index->n_entries;
+	return order;
+}
@@ -1,11 +1,13 @@
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "market.h"
 #include "session.h"
+#include "thread.h"
 #include "trade_log.h"
 #include "vector.h"
 
@@ -13,58 +15,212 @@
 #define CIX_MARKET_THREAD_COUNT 1
 #define CIX_SESSION_THREAD_COUNT 1
 
-/* XXX: read these from config file */
-static char *cix_symbols[2] = { "GOOG", "AAPL" };
+/* Idle books are released after this long */
+#define CIX_MARKET_BOOK_IDLE_SEC 60
+
+/*
+ * XXX: Configurable.  To pin threads, point cpu at an array with one CPU
+ * per thread.  Matching threads on dedicated cores should then use
+ * CIX_MARKET_WAIT_SPIN.
+ */
+static const struct cix_market_config cix_market_config = {
+	.n_thread = CIX_MARKET_THREAD_COUNT,
+	.n_lane = CIX_SESSION_THREAD_COUNT,
+	.cpu = NULL,
+	.background_cpu = CIX_THREAD_CPU_ANY,
+	.book_idle_sec = CIX_MARKET_BOOK_IDLE_SEC
+};
+
+static const struct cix_session_config cix_session_config = {
+	.n_thread = CIX_SESSION_THREAD_COUNT,
+	.cpu = NULL,
+	.accept_cpu = CIX_THREAD_CPU_ANY
+};
+
+static const struct cix_market_wait cix_market_wait = {
+	.strategy = CIX_MARKET_WAIT_PARK,
+	.spin = 1 << 12
+};
+
 static struct cix_vector *cix_symbol_vector;
 static struct cix_market *cix_market;
 
-static void
-create_symbol_vector(void)
+static int
+compare_symbols(const void *a, const void *b)
 {
-	unsigned int i;
-	size_t vector_size = sizeof(cix_symbols) / sizeof(*cix_symbols);
+	const cix_symbol_t *x = a, *y = b;
 
-	if (cix_vector_init(&cix_symbol_vector, sizeof(cix_symbol_t),
-	    vector_size) == false) {
-		fprintf(stderr, "failed to create symbol list");
-		exit(EXIT_FAILURE);
+	return strncmp(x->symbol, y->symbol, sizeof x->symbol);
+}
+
+/*
+ * Read the symbol universe from a file with one symbol per line.  Blank
+ * lines and lines starting with '#' are ignored.  The symbols are returned
+ * in sorted order.
+ */
+static struct cix_vector *
+read_symbols(const char *path)
+{
+	struct cix_vector *symbols = NULL;
+	char line[256];
+	unsigned int line_number = 0;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		perror("failed to open symbol file");
+		return NULL;
+	}
+
+	if (cix_vector_init(&symbols, sizeof(cix_symbol_t), 1024) == false) {
+		fprintf(stderr, "failed to create symbol list\n");
+		goto fail;
 	}
 
-	for (i = 0; i < vector_size; ++i) {
-		cix_symbol_t *symbol = cix_vector_next(&cix_symbol_vector);
+	while (fgets(line, sizeof line, file) != NULL) {
+		cix_symbol_t *symbol;
+		char *start = line, *end;
+
+		++line_number;
+		while (*start == ' ' || *start == '\t') {
+			++start;
+		}
+
+		end = start + strcspn(start, " \t\r\n");
+		*end = '\0';
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+
+		if (end - start > CIX_SYMBOL_MAX) {
+			fprintf(stderr, "%s:%u: symbol %s is too long\n", path,
+			    line_number, start);
+			goto fail;
+		}
 
+		symbol = cix_vector_next(&symbols);
 		if (symbol == NULL) {
 			fprintf(stderr, "failed to register symbol\n");
-			exit(EXIT_FAILURE);
+			goto fail;
 		}
 
-		strncpy(symbol->symbol, cix_symbols[i], sizeof symbol->symbol);
+		memset(symbol, 0, sizeof *symbol);
+		memcpy(symbol->symbol, start, end - start);
+	}
+
+	if (ferror(file) != 0) {
+		fprintf(stderr, "failed to read symbol file %s\n", path);
+		goto fail;
+	}
+
+	fclose(file);
+	qsort(symbols->data, cix_vector_length(symbols), sizeof(cix_symbol_t),
+	    compare_symbols);
+	return symbols;
+
+fail:
+	if (symbols != NULL) {
+		cix_vector_destroy(&symbols);
+	}
+
+	fclose(file);
+	return NULL;
+}
+
+/*
+ * Bring the market in line with the symbol file after it has changed,
+ * listing symbols that were added and delisting symbols that were
+ * removed.  Matching continues throughout.
+ */
+static void
+reload_symbols(const char *path)
+{
+	struct cix_vector *symbols = read_symbols(path);
+	unsigned int i = 0, j = 0, n_old, n_new;
+
+	if (symbols == NULL) {
+		fprintf(stderr, "keeping current symbols\n");
+		return;
+	}
+
+	n_old = cix_vector_length(cix_symbol_vector);
+	n_new = cix_vector_length(symbols);
+	while (i < n_old || j < n_new) {
+		cix_symbol_t *old = i < n_old ?
+		    cix_vector_item(cix_symbol_vector, i) : NULL;
+		cix_symbol_t *new = j < n_new ?
+		    cix_vector_item(symbols, j) : NULL;
+		int order = old == NULL ? 1 : new == NULL ? -1 :
+		    compare_symbols(old, new);
+
+		if (order < 0) {
+			(void)cix_market_symbol_retire(cix_market, old);
+			++i;
+		} else if (order > 0) {
+			(void)cix_market_symbol_add(cix_market, new);
+			++j;
+		} else {
+			++i;
+			++j;
+		}
 	}
 
+	cix_vector_destroy(&cix_symbol_vector);
+	cix_symbol_vector = symbols;
 	return;
 }
 
 int
 main(int argc, char **argv)
 {
+	sigset_t signals;
+	unsigned int i;
+	int sig;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s symbol-file\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
 
-	(void)argc;
-	(void)argv;
+	/* Every thread inherits this, so SIGHUP is only seen by sigwait. */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
 	cix_trade_log_init();
 
-	create_symbol_vector();
+	cix_symbol_vector = read_symbols(argv[1]);
+	if (cix_symbol_vector == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	cix_market = cix_market_init(cix_symbol_vector, &cix_market_config);
+
+	if (cix_market == NULL) {
+		fprintf(stderr, "failed to initialize market\n");
+		exit(EXIT_FAILURE);
+	}
 
-	cix_market = cix_market_init(cix_symbol_vector,
-	    CIX_MARKET_THREAD_COUNT);
+	for (i = 0; i < CIX_MARKET_THREAD_COUNT; ++i) {
+		if (cix_market_thread_wait(cix_market, i, &cix_market_wait) ==
+		    false) {
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	if (cix_market == NULL || cix_market_run(cix_market) == false) {
+	if (cix_market_run(cix_market) == false) {
 		fprintf(stderr, "failed to initialize market\n");
 		exit(EXIT_FAILURE);
 	}
 
-	cix_session_listen(cix_market, CIX_SESSION_THREAD_COUNT);
+	cix_session_listen(cix_market, &cix_session_config);
+
+	/* Reread the symbol file on SIGHUP */
+	for (;;) {
+		if (sigwait(&signals, &sig) == 0 && sig == SIGHUP) {
+			reload_symbols(argv[1]);
+		}
+	}
 
-	for (;;) pause();
 	return 0;
 }
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/socket.h>
@@ -20,44 +21,75 @@
 #include "messages.h"
 #include "misc.h"
 #include "session.h"
+#include "thread.h"
 #include "trade_data.h"
+#include "vector.h"
 #include "worq.h"
 
 /* XXX: Make these configurable */
 #define CIX_SESSION_ACCEPT_SOCKET "13579"
 #define CIX_SESSION_BUFFER_SIZE (1 << 14)
+#define CIX_SESSION_READ_SIZE (1 << 12)
+#define CIX_SESSION_READ_BATCH (1 << 6)
 #define CIX_SESSION_INTERNAL_QUEUE_SIZE (1 << 16)
+#define CIX_SESSION_INTERNAL_BATCH (1 << 8)
+
+/* How often to resubmit messages that the market was too busy to accept */
+#define CIX_SESSION_RETRY_NS (50 * 1000)
+
+/*
+ * How long a market thread waits for room in a session's report queue
+ * before it disconnects the session
+ */
+#define CIX_SESSION_CLAIM_TIMEOUT_NS (10 * 1000 * 1000)
 
 struct cix_session_internal_event {
 	struct cix_message message;
 };
 
-enum cix_session_read_state {
-	/* XXX: Ignore authentication and identification for now */
-	CIX_READ_STATE_MESSAGE_TYPE,
-	CIX_READ_STATE_MESSAGE_DATA
-};
+CIX_WORQ_DEFINE(cix_session_queue, struct cix_session_internal_event,
+    CIX_SESSION_INTERNAL_QUEUE_SIZE)
 
 struct cix_session {
 	int fd;
 	struct cix_event fd_event;
 
-	/* XXX: replace this with a buffer to reduce syscalls */
+	/*
+	 * Bytes read from the socket that have not been handed to the
+	 * market yet.  Only whole messages are taken out, so a partial
+	 * message stays at the front until the rest of it arrives.
+	 * XXX: Ignore authentication and identification for now
+	 */
 	struct {
-		enum cix_session_read_state state;
-		struct cix_message message;
-		size_t payload_target;
-		size_t bytes_read;
+		unsigned char data[CIX_SESSION_READ_SIZE];
+		size_t start;
+		size_t end;
 	} read;
 
 	struct cix_buffer *write_buf;
 	struct {
-		struct cix_worq queue;
+		struct cix_session_queue queue;
 		struct cix_event event;
 	} internal;
 
+	/*
+	 * Set when the market was too busy to accept every message read.
+	 * The rest stay in the read buffer and the socket is not read
+	 * again until the market has accepted them.
+	 */
+	bool blocked;
+
 	struct cix_session_thread *thread;
 	cix_user_id_t user_id;
+
+	/* See cix_session_hold */
+	unsigned int refs;
+
+	/*
+	 * Set once the session is going away, either because it
+	 * disconnected or because its reports could not be queued in time.
+	 */
+	unsigned int closing;
 };
 
 struct cix_session_thread {
@@ -84,6 +116,13 @@ struct cix_session_thread {
 		int waiting;
 	} accept;
 
+	/*
+	 * Blocked sessions, and a timer that resubmits their messages while
+	 * there are any.
+	 */
+	struct cix_vector *blocked;
+	struct cix_event retry;
+
 	pthread_t tid;
 	struct cix_market *market;
 };
@@ -93,126 +132,280 @@ static size_t cix_session_thread_count;
 
 static unsigned int cix_global_user_id;
 
-static void
-cix_session_process_message(struct cix_session *session,
-    struct cix_message *message)
+/*
+ * Hand every whole message in the read buffer to the market, a batch at a
+ * time.  Returns CIX_MARKET_BUSY, leaving the remaining messages in the
+ * buffer, if the market could not accept all of them.
+ */
+static enum cix_market_status
+cix_session_submit(struct cix_session *session)
 {
-	struct cix_message_cancel *cancel;
-	struct cix_message_order *order;
+	struct cix_message batch[CIX_SESSION_READ_BATCH];
+	size_t ends[CIX_SESSION_READ_BATCH];
+	enum cix_market_status status = CIX_MARKET_OK;
+
+	for (;;) {
+		size_t offset = session->read.start;
+		unsigned int n = 0, consumed;
+
+		while (n < CIX_SESSION_READ_BATCH &&
+		    offset < session->read.end) {
+			size_t length = cix_message_length(
+			    (enum cix_message_type)session->read.data[offset]);
+
+			if (length == 0) {
+				break;
+			}
+
+			if (session->read.end - offset < length + 1) {
+				break;
+			}
+
+			memcpy(&batch[n], &session->read.data[offset],
+			    length + 1);
+			offset += length + 1;
+			ends[n++] = offset;
+		}
 
-	switch (message->type) {
-	case CIX_MESSAGE_ORDER:
-		order = &message->payload.order;
+		if (n == 0) {
+			if (offset == session->read.end ||
+			    cix_message_length((enum cix_message_type)
+			    session->read.data[offset]) != 0) {
+				break;
+			}
+
+			/* Skip over bytes that cannot start a message. */
+			fprintf(stderr, "invalid message type\n");
+			++session->read.start;
+			continue;
+		}
+
+		status = cix_market_messages(session->thread->market,
+		    session->thread - cix_session_threads, batch, n, session,
+		    &consumed);
+		if (consumed > 0) {
+			session->read.start = ends[consumed - 1];
+		}
+
+		if (status == CIX_MARKET_BUSY) {
+			return status;
+		}
 
 		/*
-		printf("received order message: %s %" PRIu32 " shares of "
-		    "%s at %" PRIu32 "\n",
-		    order->side == CIX_TRADE_SIDE_BUY ? "BUY" : "SELL",
-		    order->quantity, order->symbol.symbol, order->price);
-		*/
-
-		if (cix_market_order(session->thread->market, order, session) ==
-		    false) {
-			fprintf(stderr, "failed to process order\n");
+		 * Only the first message that was not consumed failed, so
+		 * skip just that one and carry on with the rest.
+		 */
+		if (status == CIX_MARKET_ERROR) {
+			fprintf(stderr, "failed to process message\n");
+			if (batch[consumed].type == CIX_MESSAGE_ORDER) {
+				(void)cix_session_reject(session,
+				    batch[consumed].payload.order.external_id);
+			}
+
+			session->read.start = ends[consumed];
 		}
+	}
 
-		break;
-	case CIX_MESSAGE_CANCEL:
-		cancel = &message->payload.cancel;
-		(void)cancel;
-		//printf("cancel order ID %s\n", cancel->internal_id);
-		break;
+	memmove(session->read.data, &session->read.data[session->read.start],
+	    session->read.end - session->read.start);
+	session->read.end -= session->read.start;
+	session->read.start = 0;
+	return status;
+}
+
+/*
+ * Stop reading from a session until the market accepts its pending
+ * message, so that TCP flow control pushes back on the client instead of
+ * the message being dropped.
+ */
+static void
+cix_session_block(struct cix_session *session)
+{
+	struct cix_session_thread *thread = session->thread;
+
+	session->blocked = true;
+	if (cix_event_read_interest(&thread->event_manager,
+	    &session->fd_event, false) == false) {
+		fprintf(stderr, "failed to pause session reads\n");
+	}
+
+	if (cix_vector_append(&thread->blocked, &session) == false) {
+		fprintf(stderr, "!!!failed to block session!!!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cix_vector_length(thread->blocked) == 1 &&
+	    cix_event_timer_set(&thread->retry, CIX_SESSION_RETRY_NS) ==
+	    false) {
+		fprintf(stderr, "failed to schedule session retry\n");
 	}
 
 	return;
 }
 
+/*
+ * Resubmit the pending messages of every blocked session.  Sessions whose
+ * messages are all accepted resume reading, which epoll reports on its
+ * next pass if data arrived in the meantime.
+ */
 static void
-cix_session_close(struct cix_session *session)
+cix_session_retry(struct cix_event *event, cix_event_flags_t flags,
+    void *closure)
 {
+	struct cix_session_thread *thread = closure;
+	unsigned int i, kept = 0;
 
-	while (close(session->fd) == -1 && errno == EINTR);
+	(void)event;
+	(void)flags;
+
+	for (i = 0; i < cix_vector_length(thread->blocked); ++i) {
+		struct cix_session **session = cix_vector_item(thread->blocked,
+		    i);
+
+		if (cix_session_submit(*session) == CIX_MARKET_BUSY) {
+			*(struct cix_session **)cix_vector_item(
+			    thread->blocked, kept++) = *session;
+			continue;
+		}
+
+		(*session)->blocked = false;
+		if (cix_event_read_interest(&thread->event_manager,
+		    &(*session)->fd_event, true) == false) {
+			fprintf(stderr, "failed to resume session reads\n");
+		}
+	}
+
+	while (cix_vector_length(thread->blocked) > kept) {
+		cix_vector_remove(thread->blocked,
+		    cix_vector_length(thread->blocked) - 1);
+	}
+
+	if (kept == 0 && cix_event_timer_stop(&thread->retry) == false) {
+		fprintf(stderr, "failed to stop session retry\n");
+	}
+
+	return;
+}
+
+static inline uint64_t
+cix_session_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Free a session once nothing refers to it any more.
+ */
+static void
+cix_session_destroy(struct cix_session *session)
+{
 
 	cix_buffer_destroy(&session->write_buf);
-	cix_worq_destroy(&session->internal.queue);
+	cix_worq_destroy(&session->internal.queue.worq);
+	while (close(cix_event_fd(&session->internal.event)) == -1 &&
+	    errno == EINTR);
+	free(session);
+	return;
+}
+
+void
+cix_session_hold(struct cix_session *session, unsigned int n)
+{
+
+	ck_pr_add_uint(&session->refs, n);
+	return;
+}
+
+void
+cix_session_release(struct cix_session *session, unsigned int n)
+{
+
+	/* Everything done with the session must be visible before it goes. */
+	ck_pr_fence_release();
+	if (ck_pr_faa_uint(&session->refs, -n) != n) {
+		return;
+	}
+
+	ck_pr_fence_acquire();
+	cix_session_destroy(session);
+	return;
+}
+
+/*
+ * Disconnect a session and drop the connection's reference to it.
+ */
+static void
+cix_session_close(struct cix_session *session)
+{
+	struct cix_session_thread *thread = session->thread;
+	unsigned int i;
+
+	if (session->fd == -1) {
+		return;
+	}
+
+	ck_pr_store_uint(&session->closing, 1);
+	if (session->blocked == true) {
+		for (i = 0; i < cix_vector_length(thread->blocked); ++i) {
+			if (*(struct cix_session **)cix_vector_item(
+			    thread->blocked, i) == session) {
+				cix_vector_remove(thread->blocked, i);
+				break;
+			}
+		}
+	}
+
 	cix_event_remove(&session->thread->event_manager, &session->fd_event);
 	cix_event_remove(&session->thread->event_manager,
 	    &session->internal.event);
-	free(session);
+	while (close(session->fd) == -1 && errno == EINTR);
+	session->fd = -1;
+
+	cix_session_release(session, 1);
 	return;
 }
 
+/*
+ * Read as much as the socket has and pass it on to the market.  There is
+ * always room for at least one more message, since whatever is left in the
+ * buffer after submitting is less than a whole message.
+ */
 static void
 cix_session_read(struct cix_session *session)
 {
 	ssize_t r;
 
-	switch (session->read.state) {
-	case CIX_READ_STATE_MESSAGE_TYPE:
-read_type:
-		r = read(session->fd,
-		    &session->read.message.type + session->read.bytes_read,
-		    sizeof(session->read.message.type) -
-		    session->read.bytes_read);
+	if (session->blocked == true) {
+		return;
+	}
+
+	for (;;) {
+		r = read(session->fd, &session->read.data[session->read.end],
+		    sizeof session->read.data - session->read.end);
 		if (r == -1) {
 			switch (errno) {
 			case EINTR:
-				goto read_type;
+				continue;
 			case EAGAIN:
 				return;
 			default:
-				perror("reading message type");
+				perror("reading from session");
 				return;
 			}
 		}
 
-		session->read.bytes_read += r;
-		if (session->read.bytes_read <
-		    sizeof session->read.message.type) {
-			return;
-		}
-
-		session->read.bytes_read = 0;
-		session->read.payload_target = cix_message_length(
-		    (enum cix_message_type)(session->read.message.type & 0xFF));
-		if (session->read.payload_target == 0) {
-			fprintf(stderr, "invalid message type\n");
+		if (r == 0) {
 			return;
 		}
-		session->read.state = CIX_READ_STATE_MESSAGE_DATA;
-		/* fall-through */
-
-	case CIX_READ_STATE_MESSAGE_DATA:
-read_payload:
-		r = read(session->fd,
-		    &session->read.message.payload + session->read.bytes_read,
-		    session->read.payload_target - session->read.bytes_read);
-		if (r == -1) {
-			switch (errno) {
-			case EINTR:
-				goto read_payload;
-			case EAGAIN:
-				return;
-			default:
-				perror("reading message payload");
-				return;
-			}
-		}
 
-		session->read.bytes_read += r;
-		if (session->read.bytes_read < session->read.payload_target) {
-			fprintf(stderr, "waiting for remainder of payload\n");
+		session->read.end += r;
+		if (cix_session_submit(session) == CIX_MARKET_BUSY) {
+			cix_session_block(session);
 			return;
 		}
-
-		cix_session_process_message(session, &session->read.message);
-		session->read.bytes_read = 0;
-		session->read.state = CIX_READ_STATE_MESSAGE_TYPE;
-
-		/* Try reading another message if possible */
-		goto read_type;
-	default:
-		break;
 	}
 
 	return;
@@ -249,7 +442,8 @@ cix_session_message(cix_event_t *event, cix_event_flags_t flags, void *closure)
 {
 	struct cix_session *session = closure;
 
-	if (cix_event_flags_close(flags) == true) {
+	if (cix_event_flags_close(flags) == true ||
+	    ck_pr_load_uint(&session->closing) != 0) {
 		cix_session_close(session);
 		return;
 	}
@@ -265,34 +459,62 @@ cix_session_message(cix_event_t *event, cix_event_flags_t flags, void *closure)
 	return;
 }
 
+/*
+ * Move every report that has been published so far to the write buffer.
+ */
+static void
+cix_session_drain(struct cix_session *session)
+{
+	struct cix_session_queue *queue = &session->internal.queue;
+	struct cix_session_internal_event *internal, *first;
+	unsigned int i, n;
+
+	while ((n = cix_session_queue_pop_n(queue, CIX_SESSION_INTERNAL_BATCH,
+	    &first, CIX_WORQ_WAIT_BLOCK_SLOT)) > 0) {
+		internal = first;
+		for (i = 0; i < n; ++i) {
+			size_t message_size =
+			    cix_message_length(internal->message.type) + 1;
+
+			if (cix_buffer_append(&session->write_buf,
+			    &internal->message, message_size) == false) {
+				fprintf(stderr, "failed to write to session "
+				    "buffer\n");
+			}
+
+			internal = cix_session_queue_next(queue, internal);
+		}
+
+		cix_session_queue_complete_n(queue, first, n);
+	}
+
+	return;
+}
+
+/*
+ * A market thread that gives up on the session sets closing before it
+ * wakes the session, so that is checked once the queue has been parked.
+ */
 static void
 cix_session_internal_event(struct cix_event *event, cix_event_flags_t flags,
     void *closure)
 {
 	struct cix_session *session = closure;
-	struct cix_worq *queue = &session->internal.queue;
 
+	(void)event;
 	(void)flags;
 
-	for (;;) {
-		struct cix_session_internal_event *internal;
-		size_t message_size;
-		
-		internal = cix_worq_pop(queue, CIX_WORQ_WAIT_BLOCK_SLOT);
-		if (internal == NULL) {
-			break;
-		}
+	/* Reports that arrive while the queue is drained need no wakeup. */
+	cix_worq_unpark(&session->internal.queue.worq);
+	do {
+		cix_session_drain(session);
+	} while (cix_worq_park(&session->internal.queue.worq) == false);
 
-		message_size = cix_message_length(internal->message.type) + 1;
-		if (cix_buffer_append(&session->write_buf, &internal->message,
-		    message_size) == false) {
-			fprintf(stderr, "failed to write to session buffer\n");
-		}
-		
-		cix_worq_complete(queue, internal);
+	cix_session_write_flush(session);
+	if (ck_pr_load_uint(&session->closing) != 0) {
+		cix_session_close(session);
 	}
 
-	cix_session_write_flush(session);
 	return;
 }
 
@@ -446,9 +668,7 @@ cix_session_create(int fd, struct cix_session_thread *thread)
 		goto buffer_fail;
 	}
 
-	if (cix_worq_init(&session->internal.queue,
-	    CIX_SESSION_INTERNAL_QUEUE_SIZE,
-	    sizeof(struct cix_session_internal_event)) == false) {
+	if (cix_session_queue_init(&session->internal.queue, 0) == false) {
 		fprintf(stderr, "failed to create internal event queue\n");
 		goto queue_fail;
 	}
@@ -459,7 +679,7 @@ cix_session_create(int fd, struct cix_session_thread *thread)
 		goto event_fail;
 	}
 
-	if (cix_worq_event_subscribe(&session->internal.queue,
+	if (cix_worq_event_subscribe(&session->internal.queue.worq,
 	    &session->internal.event) == false) {
 		fprintf(stderr, "failed to subscribe to internal event "
 		    "queue\n");
@@ -467,8 +687,11 @@ cix_session_create(int fd, struct cix_session_thread *thread)
 	}
 
 	session->fd = fd;
-	session->read.state = CIX_READ_STATE_MESSAGE_TYPE;
-	session->read.bytes_read = 0;
+	session->blocked = false;
+	session->read.start = 0;
+	session->read.end = 0;
+	session->refs = 1;
+	session->closing = 0;
 
 	/* XXX: Authenticate */
 	session->user_id = ck_pr_faa_uint(&cix_global_user_id, 1);
@@ -478,7 +701,7 @@ cix_session_create(int fd, struct cix_session_thread *thread)
 
 subscribe_fail:
 event_fail:
-	cix_worq_destroy(&session->internal.queue);
+	cix_worq_destroy(&session->internal.queue.worq);
 
 queue_fail:
 	cix_buffer_destroy(&session->write_buf);
@@ -538,6 +761,14 @@ cix_session_thread(void *closure)
 		exit(EXIT_FAILURE);
 	}
 
+	if (cix_vector_init(&thread->blocked, sizeof(struct cix_session *),
+	    16) == false || cix_event_init_timer(&thread->retry,
+	    cix_session_retry, thread) == false ||
+	    cix_event_add(&thread->event_manager, &thread->retry) == false) {
+		fprintf(stderr, "failed to initialize session retry\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (cix_event_manager_run(&thread->event_manager) == false) {
 		fprintf(stderr, "failed to run session event loop\n");
 	}
@@ -550,11 +781,11 @@ cix_session_thread(void *closure)
  * connections to a thread pool for actual processing.
  */
 void
-cix_session_listen(struct cix_market *market, unsigned int n)
+cix_session_listen(struct cix_market *market,
+    const struct cix_session_config *config)
 {
 	pthread_t accept_thread;
-	int r;
-	unsigned int i;
+	unsigned int i, n = config->n_thread;
 
 	if (n == 0) {
 		fprintf(stderr, "session thread count must be positive");
@@ -573,9 +804,9 @@ cix_session_listen(struct cix_market *market, unsigned int n)
 
 		thread->market = market;
 		thread->accept.waiting = -1;
-		r = pthread_create(&thread->tid, NULL, cix_session_thread,
-		    thread);
-		if (r != 0) {
+		if (cix_thread_create(&thread->tid, config->cpu != NULL ?
+		    config->cpu[i] : CIX_THREAD_CPU_ANY, cix_session_thread,
+		    thread) == false) {
 			fprintf(stderr, "failed to create session thread\n");
 			exit(EXIT_FAILURE);
 		}
@@ -586,8 +817,8 @@ cix_session_listen(struct cix_market *market, unsigned int n)
 	 * before session threads have completed initialization.  Should fix
 	 * by adding barrier before starting accept thread.
 	 */
-	r = pthread_create(&accept_thread, NULL, cix_session_accept, NULL);
-	if (r != 0) {
+	if (cix_thread_create(&accept_thread, config->accept_cpu,
+	    cix_session_accept, NULL) == false) {
 		fprintf(stderr, "failed to create network listener thread\n");
 		exit(EXIT_FAILURE);
 	}
@@ -595,6 +826,134 @@ cix_session_listen(struct cix_market *market, unsigned int n)
 	return;
 }
 
+void
+cix_session_batch_init(struct cix_session_batch *batch)
+{
+
+	memset(batch->sessions, 0, sizeof batch->sessions);
+	batch->count = 0;
+	return;
+}
+
+void
+cix_session_batch_flush(struct cix_session_batch *batch)
+{
+	unsigned int i;
+
+	if (batch->count == 0) {
+		return;
+	}
+
+	for (i = 0; i < CIX_SESSION_BATCH_SIZE; ++i) {
+		struct cix_session *session = batch->sessions[i];
+
+		if (session == NULL) {
+			continue;
+		}
+
+		cix_worq_notify(&session->internal.queue.worq);
+		cix_session_release(session, 1);
+		batch->sessions[i] = NULL;
+	}
+
+	batch->count = 0;
+	return;
+}
+
+/*
+ * Add a session to the batch's open-addressed set if it is not already
+ * there.  If the set gets too full, flush it first so that probing stays
+ * short.
+ */
+static void
+cix_session_batch_add(struct cix_session_batch *batch,
+    struct cix_session *session)
+{
+	unsigned int i;
+
+	i = (unsigned int)(((uintptr_t)session >> 4) *
+	    UINT32_C(0x9E3779B1)) & (CIX_SESSION_BATCH_SIZE - 1);
+	for (;; i = (i + 1) & (CIX_SESSION_BATCH_SIZE - 1)) {
+		if (batch->sessions[i] == session) {
+			return;
+		}
+
+		if (batch->sessions[i] == NULL) {
+			break;
+		}
+	}
+
+	if (batch->count >= CIX_SESSION_BATCH_SIZE >> 1) {
+		cix_session_batch_flush(batch);
+		cix_session_batch_add(batch, session);
+		return;
+	}
+
+	cix_session_hold(session, 1);
+	batch->sessions[i] = session;
+	++batch->count;
+	return;
+}
+
+static void
+cix_session_publish(struct cix_session *session,
+    struct cix_session_internal_event *event,
+    struct cix_session_batch *batch)
+{
+	struct cix_session_queue *queue = &session->internal.queue;
+
+	if (batch == NULL) {
+		cix_session_queue_publish(queue, event);
+		return;
+	}
+
+	cix_session_queue_publish_deferred(queue, event);
+	cix_session_batch_add(batch, session);
+	return;
+}
+
+/*
+ * Reserve room for a report, waiting for the session thread if its queue
+ * is full.  The session thread only makes room once it has been woken for
+ * the reports that are already queued, which may still be waiting on a
+ * batch.  A session that cannot make room in time is disconnected rather
+ * than holding up the market thread.  Returns NULL if the session is going
+ * away, in which case the report is dropped.
+ */
+static struct cix_session_internal_event *
+cix_session_claim(struct cix_session *session)
+{
+	struct cix_session_queue *queue = &session->internal.queue;
+	struct cix_session_internal_event *event;
+	uint64_t deadline;
+
+	if (ck_pr_load_uint(&session->closing) != 0) {
+		return NULL;
+	}
+
+	event = cix_session_queue_claim(queue, CIX_WORQ_CLAIM_NONBLOCK);
+	if (event != NULL) {
+		return event;
+	}
+
+	cix_worq_notify(&queue->worq);
+	deadline = cix_session_now() + CIX_SESSION_CLAIM_TIMEOUT_NS;
+	do {
+		event = cix_session_queue_claim(queue, CIX_WORQ_CLAIM_SPIN);
+		if (event != NULL) {
+			return event;
+		}
+	} while (cix_session_now() < deadline);
+
+	if (ck_pr_fas_uint(&session->closing, 1) == 0) {
+		fprintf(stderr, "session %" PRIu64 " is not keeping up, "
+		    "disconnecting\n", session->user_id);
+		cix_worq_notify(&queue->worq);
+	}
+
+	return NULL;
+}
+
 cix_user_id_t
 cix_session_user_id(const struct cix_session *session)
 {
@@ -602,25 +961,51 @@ cix_session_user_id(const struct cix_session *session)
 	return session->user_id;
 }
 
+/*
+ * The ack is written straight to the socket buffer.  Only this thread
+ * drains the session's queue, so waiting for room there could block it
+ * forever.  Draining the queue first keeps the ack behind every report
+ * that was queued before it.  Reports for earlier messages that a market
+ * thread has yet to process can still follow it, just as reports for
+ * different symbols can arrive in any order.
+ */
+bool
+cix_session_reject(struct cix_session *session, const char *external_id)
+{
+	struct cix_message message;
+
+	if (ck_pr_load_uint(&session->closing) != 0) {
+		return true;
+	}
+
+	cix_session_drain(session);
+	memset(&message, 0, sizeof message);
+	message.type = CIX_MESSAGE_ACK;
+	strcpy(message.payload.ack.external_id, external_id);
+	message.payload.ack.internal_id = 0;
+	message.payload.ack.status = CIX_ORDER_STATUS_ERROR;
+
+	if (cix_buffer_append(&session->write_buf, &message,
+	    cix_message_length(message.type) + 1) == false) {
+		fprintf(stderr, "failed to write to session buffer\n");
+		return false;
+	}
+
+	cix_session_write_flush(session);
+	return true;
+}
+
 bool
 cix_session_execution_report(struct cix_session *session,
-    cix_order_id_t order_id, cix_price_t price, cix_quantity_t quantity)
+    cix_order_id_t order_id, cix_price_t price, cix_quantity_t quantity,
+    struct cix_session_batch *batch)
 {
 	struct cix_session_internal_event *event;
-	struct cix_worq *queue = &session->internal.queue;
 	struct cix_message *message;
 
-	event = cix_worq_claim(queue);
-
-	/*
-	 * XXX: Should just block here instead
-	 * XXX: Add a flag to worq_claim to indicate blocking similar
-	 * to cix_worq_pop behavior.
-	 */
+	event = cix_session_claim(session);
 	if (event == NULL) {
-		fprintf(stderr, "failed to report execution: message queue "
-		    "is full\n");
-		return false;
+		return true;
 	}
 
 	message = &event->message;
@@ -629,24 +1014,21 @@ cix_session_execution_report(struct cix_session *session,
 	message->payload.execution.price = price;
 	message->payload.execution.quantity = quantity;
 
-	cix_worq_publish(queue, event);
+	cix_session_publish(session, event, batch);
 	return true;
 }
 
 bool
 cix_session_ack_report(struct cix_session *session, const char *external_id,
-    cix_order_id_t internal_id, enum cix_order_status status)
+    cix_order_id_t internal_id, enum cix_order_status status,
+    struct cix_session_batch *batch)
 {
 	struct cix_session_internal_event *event;
-	struct cix_worq *queue = &session->internal.queue;
 	struct cix_message *message;
 
-	event = cix_worq_claim(queue);
-
+	event = cix_session_claim(session);
 	if (event == NULL) {
-		fprintf(stderr, "failed to report ack: message queue is "
-		    "full\n");
-		return false;
+		return true;
 	}
 
 	message = &event->message;
@@ -655,6 +1037,53 @@ cix_session_ack_report(struct cix_session *session, const char *external_id,
 	message->payload.ack.internal_id = internal_id;
 	message->payload.ack.status = status;
 
-	cix_worq_publish(queue, event);
+	cix_session_publish(session, event, batch);
+	return true;
+}
+
+bool
+cix_session_cancel_report(struct cix_session *session,
+    cix_order_id_t internal_id, cix_quantity_t quantity,
+    enum cix_order_status status, struct cix_session_batch *batch)
+{
+	struct cix_session_internal_event *event;
+	struct cix_message *message;
+
+	event = cix_session_claim(session);
+	if (event == NULL) {
+		return true;
+	}
+
+	message = &event->message;
+	message->type = CIX_MESSAGE_CANCEL_ACK;
+	message->payload.cancel_ack.internal_id = internal_id;
+	message->payload.cancel_ack.quantity = quantity;
+	message->payload.cancel_ack.status = status;
+
+	cix_session_publish(session, event, batch);
+	return true;
+}
+
+bool
+cix_session_replace_report(struct cix_session *session,
+    cix_order_id_t internal_id, cix_quantity_t remaining, cix_price_t price,
+    enum cix_order_status status, struct cix_session_batch *batch)
+{
+	struct cix_session_internal_event *event;
+	struct cix_message *message;
+
+	event = cix_session_claim(session);
+	if (event == NULL) {
+		return true;
+	}
+
+	message = &event->message;
+	message->type = CIX_MESSAGE_REPLACE_ACK;
+	message->payload.replace_ack.internal_id = internal_id;
+	message->payload.replace_ack.remaining = remaining;
+	message->payload.replace_ack.price = price;
+	message->payload.replace_ack.status = status;
+
+	cix_session_publish(session, event, batch);
 	return true;
 }
@@ -12,6 +12,7 @@
 #include <sys/types.h>
 
 #include "event.h"
+#include "thread.h"
 #include "trade_data.h"
 #include "trade_log.h"
 
@@ -215,8 +216,8 @@ cix_trade_log_manager_init(struct cix_trade_log_manager *manager,
 
 	manager->active_file = 0;
 
-	if (pthread_create(&manager->rotate_thread, NULL,
-	    cix_trade_log_rotate_thread, manager) != 0) {
+	if (cix_thread_create(&manager->rotate_thread, config->cpu,
+	    cix_trade_log_rotate_thread, manager) == false) {
 		fprintf(stderr,
 		    "failed to initialize log maintenance thread\n");
 		    return false;
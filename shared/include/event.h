@@ -43,8 +43,11 @@ bool cix_event_init_managed(struct cix_event *, cix_event_handler_t, void *);
 bool cix_event_init_timer(struct cix_event *, cix_event_handler_t, void *);
 bool cix_event_add(struct cix_event_manager *, struct cix_event *);
 bool cix_event_remove(struct cix_event_manager *, struct cix_event *);
+bool cix_event_read_interest(struct cix_event_manager *, struct cix_event *,
+    bool);
 
 bool cix_event_managed_trigger(struct cix_event *);
+bool cix_event_managed_wait(struct cix_event *);
 
 bool cix_event_timer_set(struct cix_event *, unsigned long long);
 bool cix_event_timer_stop(struct cix_event *);
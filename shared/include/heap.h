@@ -28,5 +28,62 @@ void *cix_heap_peek(struct cix_heap *);
 void *cix_heap_pop(struct cix_heap *);
 void cix_heap_destroy(struct cix_heap *);
 
+/*
+ * d-ary heap with stable handles, so that any item can be removed or
+ * rescored in O(log n).  Nodes only hold the score and handle, and the
+ * node array is aligned so that all children of a node share a cache
+ * line.  Ordering is fixed at compile time: use the cix_dheap_min_* or
+ * cix_dheap_max_* functions, but never both on the same heap.
+ *
+ * CIX_DHEAP_ARITY may only be overridden with a value whose children
+ * exactly fill a cache line, which is checked at compile time.
+ *
+ * This is not thread-safe
+ */
+#ifndef CIX_DHEAP_ARITY
+#define CIX_DHEAP_ARITY 4
+#endif
+
+typedef uint32_t cix_dheap_handle_t;
+
+struct cix_dheap_node {
+	cix_heap_score_t score;
+	cix_dheap_handle_t handle;
+};
+
+/*
+ * Handles index this table.  While a handle is in use, position is the
+ * index of its node; otherwise it links to the next free handle.
+ */
+struct cix_dheap_slot {
+	void *item;
+	size_t position;
+};
+
+struct cix_dheap {
+	struct cix_dheap_node *nodes;
+	struct cix_dheap_slot *slots;
+	size_t n_elements;
+	size_t capacity;
+	size_t free_slot;
+};
+
+bool cix_dheap_init(struct cix_dheap *, size_t);
+void cix_dheap_destroy(struct cix_dheap *);
+void *cix_dheap_peek(const struct cix_dheap *);
+void *cix_dheap_item(const struct cix_dheap *, cix_dheap_handle_t);
+
+#define CIX_DHEAP_DECLARE(ORDER)					\
+bool cix_dheap_##ORDER##_push(struct cix_dheap *, void *,		\
+    cix_heap_score_t, cix_dheap_handle_t *);				\
+void *cix_dheap_##ORDER##_pop(struct cix_dheap *);			\
+void *cix_dheap_##ORDER##_remove(struct cix_dheap *,			\
+    cix_dheap_handle_t);						\
+void cix_dheap_##ORDER##_update(struct cix_dheap *, cix_dheap_handle_t,	\
+    cix_heap_score_t);
+
+CIX_DHEAP_DECLARE(min)
+CIX_DHEAP_DECLARE(max)
+
 
 #endif /* _CIX_HEAP_H */
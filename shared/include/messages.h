@@ -32,7 +32,10 @@ enum cix_message_type {
 	CIX_MESSAGE_ORDER = 0,
 	CIX_MESSAGE_CANCEL,
 	CIX_MESSAGE_EXECUTION,
-	CIX_MESSAGE_ACK
+	CIX_MESSAGE_ACK,
+	CIX_MESSAGE_CANCEL_ACK,
+	CIX_MESSAGE_REPLACE,
+	CIX_MESSAGE_REPLACE_ACK
 };
 
 enum cix_trade_side {
@@ -40,6 +43,18 @@ enum cix_trade_side {
 	CIX_TRADE_SIDE_SELL = 1
 };
 
+/*
+ * Limit orders rest on the book until they are filled or cancelled.
+ * Immediate-or-cancel orders match as far as their limit price allows and
+ * market orders match at any price; in both cases any quantity left over
+ * is cancelled immediately rather than rested.
+ */
+enum cix_order_type {
+	CIX_ORDER_TYPE_LIMIT = 0,
+	CIX_ORDER_TYPE_IOC,
+	CIX_ORDER_TYPE_MARKET
+};
+
 enum cix_order_status {
 	CIX_ORDER_STATUS_OK = 0,
 	CIX_ORDER_STATUS_ERROR
@@ -56,6 +71,7 @@ struct cix_message_order {
 	cix_quantity_t quantity CIX_STRUCT_PACKED;
 	cix_price_t price CIX_STRUCT_PACKED;
 	uint8_t side;
+	uint8_t type;
 	char external_id[CIX_EXTERNAL_ID_MAX + 1];
 } CIX_STRUCT_PACKED;
 
@@ -69,6 +85,45 @@ struct cix_message_ack {
 	uint8_t status;
 } CIX_STRUCT_PACKED;
 
+/*
+ * Modify the price and/or size of a resting order.  As with a new order,
+ * quantity is the total size of the order including any shares that have
+ * already executed, so a replace that crosses with a fill cannot cause the
+ * order to be overfilled.  If the new quantity does not exceed the shares
+ * already executed, the remainder of the order is cancelled.
+ *
+ * Reducing the quantity at the same price keeps the order's queue
+ * priority.  Any other change moves the order to the back of the queue
+ * at its (new) price level, and it may execute immediately if the new
+ * price crosses the book.
+ */
+struct cix_message_replace {
+	cix_order_id_t internal_id;
+	cix_quantity_t quantity CIX_STRUCT_PACKED;
+	cix_price_t price CIX_STRUCT_PACKED;
+} CIX_STRUCT_PACKED;
+
+/*
+ * Sent in response to a replace request, with the number of shares
+ * remaining on the book after the replace and the order's new price.
+ */
+struct cix_message_replace_ack {
+	cix_order_id_t internal_id;
+	cix_quantity_t remaining CIX_STRUCT_PACKED;
+	cix_price_t price CIX_STRUCT_PACKED;
+	uint8_t status;
+} CIX_STRUCT_PACKED;
+
+/*
+ * Sent in response to a cancel request.  The quantity is the number of
+ * unexecuted shares that were removed from the book.
+ */
+struct cix_message_cancel_ack {
+	cix_order_id_t internal_id;
+	cix_quantity_t quantity CIX_STRUCT_PACKED;
+	uint8_t status;
+} CIX_STRUCT_PACKED;
+
 struct cix_message_execution {
 	cix_order_id_t order_id CIX_STRUCT_PACKED;
 	cix_price_t price CIX_STRUCT_PACKED;
@@ -80,6 +135,9 @@ union cix_message_payload {
 	struct cix_message_cancel cancel;
 	struct cix_message_execution execution;
 	struct cix_message_ack ack;
+	struct cix_message_cancel_ack cancel_ack;
+	struct cix_message_replace replace;
+	struct cix_message_replace_ack replace_ack;
 } CIX_STRUCT_PACKED;
 
 struct cix_message {
@@ -100,6 +158,12 @@ cix_message_length(enum cix_message_type type)
 		return sizeof(struct cix_message_execution);
 	case CIX_MESSAGE_ACK:
 		return sizeof(struct cix_message_ack);
+	case CIX_MESSAGE_CANCEL_ACK:
+		return sizeof(struct cix_message_cancel_ack);
+	case CIX_MESSAGE_REPLACE:
+		return sizeof(struct cix_message_replace);
+	case CIX_MESSAGE_REPLACE_ACK:
+		return sizeof(struct cix_message_replace_ack);
 	default:
 		return 0;
 	}
@@ -0,0 +1,68 @@
+#ifndef _CIX_SLAB_H
+#define _CIX_SLAB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Fixed-size object allocator.  Objects are carved out of large
+ * cache-line aligned chunks and recycled through an intrusive free list,
+ * so that steady-state allocation and release never enter the system
+ * allocator.  A new chunk is only allocated once every preallocated
+ * object is in use.
+ *
+ * This is not thread-safe; each thread should use its own slab.  The
+ * statistics may be read from other threads.
+ */
+
+struct cix_slab_object {
+	struct cix_slab_object *next;
+};
+
+struct cix_slab_chunk;
+
+struct cix_slab_stats {
+	/* Number of chunks allocated so far */
+	uint64_t chunks;
+
+	/* Total number of objects across all chunks */
+	uint64_t capacity;
+
+	/* Number of objects currently allocated */
+	uint64_t in_use;
+
+	/* Greatest value of in_use observed */
+	uint64_t high_water;
+
+	/* Number of calls to cix_slab_alloc that returned an object */
+	uint64_t allocations;
+};
+
+struct cix_slab {
+	struct cix_slab_object *free_list;
+	struct cix_slab_chunk *chunks;
+
+	size_t object_size;
+	unsigned int chunk_objects;
+
+	struct cix_slab_stats stats;
+};
+
+/*
+ * Initialize a slab for objects of the given size, with the given number
+ * of objects per chunk and number of chunks to allocate up front.
+ */
+bool cix_slab_init(struct cix_slab *, size_t, unsigned int, unsigned int);
+void cix_slab_destroy(struct cix_slab *);
+
+/*
+ * Returns NULL if there are no free objects and a new chunk cannot be
+ * allocated.
+ */
+void *cix_slab_alloc(struct cix_slab *);
+void cix_slab_free(struct cix_slab *, void *);
+
+void cix_slab_stats(const struct cix_slab *, struct cix_slab_stats *);
+
+#endif /* _CIX_SLAB_H */
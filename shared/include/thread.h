@@ -0,0 +1,30 @@
+#ifndef _CIX_THREAD_H
+#define _CIX_THREAD_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/*
+ * Thread placement.  A thread that is pinned to a CPU also gets memory on
+ * that CPU's NUMA node for every page that it touches first, so threads
+ * should touch the data structures they own before anyone else does.
+ */
+
+/* Let the scheduler run the thread anywhere */
+#define CIX_THREAD_CPU_ANY	(-1)
+
+typedef void *(*cix_thread_start_t)(void *);
+
+/*
+ * Start a thread on the given CPU, or anywhere if it is CIX_THREAD_CPU_ANY.
+ */
+bool cix_thread_create(pthread_t *, int, cix_thread_start_t, void *);
+
+/*
+ * Run a function to completion on the given CPU and return its result.
+ * This is meant for initialization that should allocate memory on the node
+ * of the thread that will later use it.
+ */
+bool cix_thread_call(int, cix_thread_start_t, void *, void **);
+
+#endif /* _CIX_THREAD_H */
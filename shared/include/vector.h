@@ -32,6 +32,13 @@ bool cix_vector_append(struct cix_vector **, void *);
  */
 void *cix_vector_next(struct cix_vector **);
 
+/*
+ * Shift all elements at or after the given index back by one and return
+ * the vacated slot for direct writing.
+ * Returns NULL if the index is out of range or memory cannot be allocated.
+ */
+void *cix_vector_insert(struct cix_vector **, unsigned int);
+
 void *cix_vector_item(struct cix_vector *, unsigned int);
 void cix_vector_remove(struct cix_vector *, unsigned int);
 
@@ -2,7 +2,10 @@
 #define _CIX_WORQ_H
 
 #include <ck_cc.h>
+#include <ck_md.h>
+#include <ck_pr.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -20,42 +23,136 @@ enum cix_worq_wait {
 	CIX_WORQ_WAIT_BLOCK
 };
 
+/*
+ * What a producer does when the queue is full.
+ */
+enum cix_worq_claim_wait {
+	/* Return immediately */
+	CIX_WORQ_CLAIM_NONBLOCK,
+
+	/* Spin for up to CIX_WORQ_CLAIM_SPIN attempts and then give up */
+	CIX_WORQ_CLAIM_SPIN,
+
+	/*
+	 * Spin for up to CIX_WORQ_CLAIM_SPIN attempts and then sleep until
+	 * the consumer makes room.  This never fails.
+	 */
+	CIX_WORQ_CLAIM_BLOCK
+};
+
+#define CIX_WORQ_CLAIM_SPIN	(1 << 10)
+
 /*
  * Work queue based loosely on LMAX disruptor pattern.
- * Current implementation is intended for multi-producer, single-consumer
+ * By default the queue is intended for multi-producer, single-consumer
  * workloads.  Producers are lock-free, but consumers can be blocked by
  * producer threads between the time that the producer claims a slot and the
  * time that they finish writing to it.
  */
 
+/*
+ * Only one thread ever claims slots, so producers reserve them with plain
+ * stores instead of competing for the cursor, and only read the consumer's
+ * cursor when the queue looks full.
+ */
+#define CIX_WORQ_SINGLE_PRODUCER	(1UL << 0)
+
+/*
+ * Any number of threads pop from the queue, each claiming the items it
+ * pops with an atomic cursor, and they may complete them in any order.
+ * Slots are only reused once every item before them has been completed,
+ * so an item that takes long to process holds up producers but not other
+ * consumers.  With an event, producers only guarantee that some consumer
+ * is woken.
+ */
+#define CIX_WORQ_MULTI_CONSUMER		(1UL << 1)
+
 struct cix_event;
 
+/*
+ * Header of every slot, followed by the item itself.  Each slot is padded
+ * out to a whole number of cache lines.
+ */
+struct cix_worq_item {
+	unsigned int ready;
+
+	/*
+	 * Position of the item in the queue, recorded by whichever consumer
+	 * popped it from a multi-consumer queue.
+	 */
+	uint64_t sequence;
+
+	unsigned char data[];
+};
+
+#define CIX_WORQ_SLOT_SIZE(ITEM_SIZE)					\
+    (((ITEM_SIZE) + sizeof(struct cix_worq_item) + CK_MD_CACHELINE - 1) & \
+    ~(size_t)(CK_MD_CACHELINE - 1))
+
 struct cix_worq {
 	unsigned char *items;
 
 	size_t slot_size;
 	unsigned int size;
 	uint64_t mask;
+	unsigned long flags;
 
 	uint64_t consume_cursor CK_CC_CACHELINE;
 	uint64_t produce_cursor CK_CC_CACHELINE;
 
+	/* Next item to hand out with CIX_WORQ_MULTI_CONSUMER */
+	uint64_t pop_cursor CK_CC_CACHELINE;
+
+	/* Last consume cursor seen by a single producer */
+	uint64_t consume_cached;
+
 	struct cix_event *event;
+
+	/* Set while the consumer may be waiting on the event */
+	unsigned int parked CK_CC_CACHELINE;
+
+	/*
+	 * Producers sleeping until there is room, and a futex word that the
+	 * consumer bumps to wake them.
+	 */
+	unsigned int waiters;
+	unsigned int space;
 };
 
-bool cix_worq_init(struct cix_worq *, size_t, unsigned int);
+bool cix_worq_init(struct cix_worq *, size_t, unsigned int, unsigned long);
 void cix_worq_destroy(struct cix_worq *);
 
 /*
- * Reserve slot for producer to write data.
+ * Reserve slot for producer to write data.  Returns NULL if the queue is
+ * full, after waiting as requested.
  */
-void *cix_worq_claim(struct cix_worq *);
+void *cix_worq_claim(struct cix_worq *, enum cix_worq_claim_wait);
 
 /*
  * Mark a slot as written and ready for consumer.
  */
 void cix_worq_publish(struct cix_worq *, void *);
 
+/*
+ * Reserve up to the given number of consecutive slots at once.  Returns
+ * the number reserved, which is 0 if the queue is full, and sets the
+ * pointer argument to the first of them.  Only the first slot is waited
+ * for.  Use cix_worq_next to step through the rest and cix_worq_publish_n
+ * to publish them all together.
+ */
+unsigned int cix_worq_claim_n(struct cix_worq *, unsigned int, void **,
+    enum cix_worq_claim_wait);
+void *cix_worq_next(struct cix_worq *, void *);
+void cix_worq_publish_n(struct cix_worq *, void *, unsigned int);
+
+/*
+ * Mark a slot as ready without notifying the consumer.  The producer must
+ * call cix_worq_notify at some point afterward, which allows a run of
+ * publishes to share a single wakeup.
+ */
+void cix_worq_publish_deferred(struct cix_worq *, void *);
+void cix_worq_notify(struct cix_worq *);
+
 /*
  * Consume the last element in the queue.
  */
@@ -66,9 +163,367 @@ void *cix_worq_pop(struct cix_worq *, enum cix_worq_wait);
  */
 void cix_worq_complete(struct cix_worq *, void *);
 
+/*
+ * Consume up to the given number of consecutive items at once.  Returns
+ * how many were ready, which stops short at the first slot that has been
+ * claimed but not yet published, and sets the pointer argument to the
+ * first of them.  Use cix_worq_next to step through the rest and
+ * cix_worq_complete_n to release them all together once they have been
+ * processed.
+ */
+unsigned int cix_worq_pop_n(struct cix_worq *, unsigned int, void **,
+    enum cix_worq_wait);
+void cix_worq_complete_n(struct cix_worq *, void *, unsigned int);
+
+/*
+ * Wake any producers that went to sleep while the queue was full.  The
+ * consumer calls this after moving the consume cursor.
+ */
+void cix_worq_release(struct cix_worq *);
+
+/*
+ * Number of slots that have been claimed but not yet completed.  This is
+ * only a snapshot when called concurrently with producers or the consumer.
+ */
+unsigned int cix_worq_length(struct cix_worq *);
+
 /*
  * Provide an event that will be triggered whenever new items become available.
  */
 bool cix_worq_event_subscribe(struct cix_worq *, struct cix_event *event);
 
+/*
+ * Producers only trigger the event while the consumer is parked, and only
+ * the first of them to see it parked does so.  A consumer calls
+ * cix_worq_park once it finds the queue empty and before it waits on the
+ * event.  If that returns false, items arrived in the meantime and the
+ * consumer should keep going instead of waiting.  After waking up it calls
+ * cix_worq_unpark.  A queue starts out parked.
+ */
+bool cix_worq_park(struct cix_worq *);
+void cix_worq_unpark(struct cix_worq *);
+
+static inline struct cix_worq_item *
+cix_worq_item(void *data)
+{
+
+	return (struct cix_worq_item *)((unsigned char *)data -
+	    offsetof(struct cix_worq_item, data));
+}
+
+/*
+ * The slot protocol itself, shared by the functions above and the typed
+ * queues below.  Each of these takes the slot size and length of the
+ * queue, which the typed queues know at compile time.
+ */
+static inline struct cix_worq_item *
+cix_worq_ring_slot(const struct cix_worq *worq, uint64_t index,
+    size_t slot_size, unsigned int size)
+{
+
+	return (struct cix_worq_item *)(worq->items +
+	    (index & (size - 1)) * slot_size);
+}
+
+static inline struct cix_worq_item *
+cix_worq_ring_next(const struct cix_worq *worq, struct cix_worq_item *item,
+    size_t slot_size, unsigned int size)
+{
+	unsigned char *next = (unsigned char *)item + slot_size;
+
+	if (next == worq->items + size * slot_size) {
+		next = worq->items;
+	}
+
+	return (struct cix_worq_item *)next;
+}
+
+/*
+ * Reserve up to n slots without waiting, and return how many were
+ * reserved starting at *index.  The only producer of a single-producer
+ * queue moves the cursor itself.  The consumer's cursor only ever moves
+ * forward, so a stale copy of it can only understate the space that is
+ * available.
+ */
+static inline unsigned int
+cix_worq_ring_reserve(struct cix_worq *worq, unsigned int n,
+    unsigned int size, uint64_t *index)
+{
+	uint64_t end;
+
+	if (worq->flags & CIX_WORQ_SINGLE_PRODUCER) {
+		*index = worq->produce_cursor;
+		if (*index - worq->consume_cached + n > size) {
+			worq->consume_cached =
+			    ck_pr_load_64(&worq->consume_cursor);
+			if (n > size - (*index - worq->consume_cached)) {
+				n = size - (*index - worq->consume_cached);
+			}
+		}
+
+		ck_pr_store_64(&worq->produce_cursor, *index + n);
+		return n;
+	}
+
+	for (;;) {
+		unsigned int claimed = n;
+
+		end = ck_pr_load_64(&worq->consume_cursor);
+		*index = ck_pr_load_64(&worq->produce_cursor);
+
+		/* Queue is full */
+		if (*index - end >= size) {
+			return 0;
+		}
+
+		if (claimed > size - (*index - end)) {
+			claimed = size - (*index - end);
+		}
+
+		if (ck_pr_cas_64(&worq->produce_cursor, *index,
+		    *index + claimed) == true) {
+			return claimed;
+		}
+	}
+}
+
+/*
+ * Mark a run of written slots as ready.  One fence covers every slot in
+ * the run, since none of them is visible to the consumer until its ready
+ * flag is set.
+ */
+static inline void
+cix_worq_ring_publish(const struct cix_worq *worq, struct cix_worq_item *item,
+    unsigned int n, size_t slot_size, unsigned int size)
+{
+	unsigned int i;
+
+	ck_pr_fence_release();
+	for (i = 0; i < n; ++i) {
+		ck_pr_store_uint(&item->ready, 1);
+		item = cix_worq_ring_next(worq, item, slot_size, size);
+	}
+
+	return;
+}
+
+/*
+ * Count up to n published items at the consume cursor of a single-consumer
+ * queue, stopping at the first slot that has been claimed but not yet
+ * published.
+ */
+static inline unsigned int
+cix_worq_ring_ready(const struct cix_worq *worq, unsigned int n,
+    size_t slot_size, unsigned int size)
+{
+	uint64_t available = ck_pr_load_64(&worq->produce_cursor) -
+	    worq->consume_cursor;
+	struct cix_worq_item *item = cix_worq_ring_slot(worq,
+	    worq->consume_cursor, slot_size, size);
+	unsigned int count = 0;
+
+	while (count < n && count < available &&
+	    ck_pr_load_uint(&item->ready) != 0) {
+		item = cix_worq_ring_next(worq, item, slot_size, size);
+		++count;
+	}
+
+	if (count > 0) {
+		ck_pr_fence_acquire();
+	}
+
+	return count;
+}
+
+/*
+ * Hand a run of items at the consume cursor of a single-consumer queue
+ * back to producers.  They may reuse the slots as soon as the cursor
+ * moves, so everything done with them has to be visible first.
+ */
+static inline void
+cix_worq_ring_complete(struct cix_worq *worq, struct cix_worq_item *item,
+    unsigned int n, size_t slot_size, unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		ck_pr_store_uint(&item->ready, 0);
+		item = cix_worq_ring_next(worq, item, slot_size, size);
+	}
+
+	ck_pr_fence_release();
+	ck_pr_store_64(&worq->consume_cursor, worq->consume_cursor + n);
+	ck_pr_fence_memory();
+	if (ck_pr_load_uint(&worq->waiters) != 0) {
+		cix_worq_release(worq);
+	}
+
+	return;
+}
+
+/*
+ * Define a queue of a single item type and length, whose slot size and
+ * mask are known at compile time.  The length must be a power of two.
+ * The common case of each operation is inlined, and anything else, such as
+ * a full queue or a multi-consumer pop, falls through to the functions
+ * above.  Batches claimed or popped with NAME_claim_n and NAME_pop_n are
+ * stepped through with NAME_next.  The underlying struct cix_worq is the
+ * worq member, which is used directly for everything else.
+ */
+#define CIX_WORQ_DEFINE(NAME, TYPE, LENGTH)				\
+struct NAME {								\
+	struct cix_worq worq;						\
+};									\
+									\
+typedef char NAME##_length_check[					\
+    ((LENGTH) & ((LENGTH) - 1)) == 0 ? 1 : -1];			\
+									\
+static inline bool							\
+NAME##_init(struct NAME *queue, unsigned long flags)			\
+{									\
+									\
+	return cix_worq_init(&queue->worq, sizeof(TYPE), (LENGTH),	\
+	    flags);							\
+}									\
+									\
+static inline TYPE *							\
+NAME##_slot(struct NAME *queue, uint64_t index)				\
+{									\
+									\
+	return (TYPE *)cix_worq_ring_slot(&queue->worq, index,		\
+	    CIX_WORQ_SLOT_SIZE(sizeof(TYPE)), (LENGTH))->data;		\
+}									\
+									\
+static inline TYPE *							\
+NAME##_next(struct NAME *queue, TYPE *data)				\
+{									\
+									\
+	return (TYPE *)cix_worq_ring_next(&queue->worq,		\
+	    cix_worq_item(data), CIX_WORQ_SLOT_SIZE(sizeof(TYPE)),	\
+	    (LENGTH))->data;						\
+}									\
+									\
+static inline unsigned int						\
+NAME##_claim_n(struct NAME *queue, unsigned int n, TYPE **first,	\
+    enum cix_worq_claim_wait wait)					\
+{									\
+	unsigned int claimed;						\
+	uint64_t index;							\
+	void *slot;							\
+									\
+	claimed = cix_worq_ring_reserve(&queue->worq, n, (LENGTH), &index); \
+	if (claimed > 0) {						\
+		*first = NAME##_slot(queue, index);			\
+		return claimed;						\
+	}								\
+									\
+	if (wait == CIX_WORQ_CLAIM_NONBLOCK) {				\
+		return 0;						\
+	}								\
+									\
+	claimed = cix_worq_claim_n(&queue->worq, n, &slot, wait);	\
+	if (claimed > 0) {						\
+		*first = slot;						\
+	}								\
+									\
+	return claimed;							\
+}									\
+									\
+static inline TYPE *							\
+NAME##_claim(struct NAME *queue, enum cix_worq_claim_wait wait)	\
+{									\
+	TYPE *data;							\
+									\
+	return NAME##_claim_n(queue, 1, &data, wait) > 0 ? data : NULL;	\
+}									\
+									\
+static inline void							\
+NAME##_publish_n(struct NAME *queue, TYPE *first, unsigned int n)	\
+{									\
+									\
+	if (n == 0) {							\
+		return;							\
+	}								\
+									\
+	cix_worq_ring_publish(&queue->worq, cix_worq_item(first), n,	\
+	    CIX_WORQ_SLOT_SIZE(sizeof(TYPE)), (LENGTH));		\
+	if (queue->worq.event != NULL) {				\
+		cix_worq_notify(&queue->worq);				\
+	}								\
+									\
+	return;								\
+}									\
+									\
+static inline void							\
+NAME##_publish_deferred(struct NAME *queue, TYPE *data)		\
+{									\
+									\
+	cix_worq_ring_publish(&queue->worq, cix_worq_item(data), 1,	\
+	    CIX_WORQ_SLOT_SIZE(sizeof(TYPE)), (LENGTH));		\
+	return;								\
+}									\
+									\
+static inline void							\
+NAME##_publish(struct NAME *queue, TYPE *data)				\
+{									\
+									\
+	NAME##_publish_n(queue, data, 1);				\
+	return;								\
+}									\
+									\
+static inline unsigned int						\
+NAME##_pop_n(struct NAME *queue, unsigned int n, TYPE **first,		\
+    enum cix_worq_wait wait)						\
+{									\
+	unsigned int count;						\
+	void *slot;							\
+									\
+	if ((queue->worq.flags & CIX_WORQ_MULTI_CONSUMER) == 0) {	\
+		count = cix_worq_ring_ready(&queue->worq, n,		\
+		    CIX_WORQ_SLOT_SIZE(sizeof(TYPE)), (LENGTH));	\
+		if (count > 0) {					\
+			*first = NAME##_slot(queue,			\
+			    queue->worq.consume_cursor);		\
+			return count;					\
+		}							\
+	}								\
+									\
+	count = cix_worq_pop_n(&queue->worq, n, &slot, wait);		\
+	if (count > 0) {						\
+		*first = slot;						\
+	}								\
+									\
+	return count;							\
+}									\
+									\
+static inline TYPE *							\
+NAME##_pop(struct NAME *queue, enum cix_worq_wait wait)		\
+{									\
+	TYPE *data;							\
+									\
+	return NAME##_pop_n(queue, 1, &data, wait) > 0 ? data : NULL;	\
+}									\
+									\
+static inline void							\
+NAME##_complete_n(struct NAME *queue, TYPE *first, unsigned int n)	\
+{									\
+									\
+	if (queue->worq.flags & CIX_WORQ_MULTI_CONSUMER) {		\
+		cix_worq_complete_n(&queue->worq, first, n);		\
+		return;							\
+	}								\
+									\
+	cix_worq_ring_complete(&queue->worq, cix_worq_item(first), n,	\
+	    CIX_WORQ_SLOT_SIZE(sizeof(TYPE)), (LENGTH));		\
+	return;								\
+}									\
+									\
+static inline void							\
+NAME##_complete(struct NAME *queue, TYPE *data)			\
+{									\
+									\
+	NAME##_complete_n(queue, data, 1);				\
+	return;								\
+}
+
 #endif /* _CIX_WORQ_H */
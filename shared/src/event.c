@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <sys/epoll.h>
@@ -73,17 +74,19 @@ cix_event_manager_run(struct cix_event_manager *manager)
 		for (i = 0; i < r; ++i) {
 			struct cix_event *event = events[i].data.ptr;
 			uint32_t flags = events[i].events;
+			enum cix_event_type type = event->type;
 
-			if (event->type == CIX_EVENT_MANAGED) {
+			if (type == CIX_EVENT_MANAGED) {
 				if ((flags & EPOLLIN) == 0) {
 					continue;
 				}
 				cix_event_managed_drain(event);
 			}
 
+			/* The handler may free the event unless it is a timer. */
 			event->handler(event, flags, event->closure);
 
-			if (event->type == CIX_EVENT_TIMER &&
+			if (type == CIX_EVENT_TIMER &&
 			    cix_event_timer_set(event, event->data.timer.ns) ==
 			    false) {
 				fprintf(stderr, "failed to reset timer\n");
@@ -161,6 +164,32 @@ cix_event_add(struct cix_event_manager *manager, struct cix_event *event)
 	return true;
 }
 
+/*
+ * Stop or resume reporting that an event's fd is readable.  Resuming
+ * reports the fd again right away if data arrived in the meantime.
+ */
+bool
+cix_event_read_interest(struct cix_event_manager *manager,
+    struct cix_event *event, bool read)
+{
+	struct epoll_event epoll;
+	int r;
+
+	epoll.data.ptr = event;
+	epoll.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	if (read == true) {
+		epoll.events |= EPOLLIN;
+	}
+
+	r = epoll_ctl(manager->epoll_fd, EPOLL_CTL_MOD, event->fd, &epoll);
+	if (r == -1) {
+		perror("modifying event");
+		return false;
+	}
+
+	return true;
+}
+
 bool
 cix_event_remove(struct cix_event_manager *manager, struct cix_event *event)
 {
@@ -175,6 +204,33 @@ cix_event_remove(struct cix_event_manager *manager, struct cix_event *event)
 	return true;
 }
 
+/*
+ * Block until a managed event has been triggered, without an event loop,
+ * and reset it.
+ */
+bool
+cix_event_managed_wait(struct cix_event *event)
+{
+	struct pollfd fd = { .fd = event->fd, .events = POLLIN };
+	int r;
+
+	assert(event->type == CIX_EVENT_MANAGED);
+
+	for (;;) {
+		r = poll(&fd, 1, -1);
+		if (r > 0)
+			break;
+
+		if (r == -1 && errno != EINTR) {
+			fprintf(stderr, "failed to wait for managed event\n");
+			return false;
+		}
+	}
+
+	cix_event_managed_drain(event);
+	return true;
+}
+
 bool
 cix_event_managed_trigger(struct cix_event *event)
 {
@@ -1,6 +1,8 @@
+#include <ck_md.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "heap.h"
 
@@ -112,3 +114,285 @@ cix_heap_destroy(struct cix_heap *heap)
 
 	free(heap->elements);
 }
+
+/*
+ * Leading padding so that the children of each node, which start at index
+ * CIX_DHEAP_ARITY * n + 1, begin on a cache line boundary.
+ */
+#define CIX_DHEAP_PAD		(CIX_DHEAP_ARITY - 1)
+#define CIX_DHEAP_PARENT(N)	(((N) - 1) / CIX_DHEAP_ARITY)
+#define CIX_DHEAP_CHILD(N)	((N) * CIX_DHEAP_ARITY + 1)
+#define CIX_DHEAP_NONE		SIZE_MAX
+
+/* An overridden arity must still fill exactly one cache line. */
+typedef char cix_dheap_arity_check[
+    CIX_DHEAP_ARITY * sizeof(struct cix_dheap_node) == CK_MD_CACHELINE ?
+    1 : -1];
+
+static struct cix_dheap_node *
+cix_dheap_nodes(size_t capacity)
+{
+	struct cix_dheap_node *nodes;
+
+	if (posix_memalign((void **)&nodes, CK_MD_CACHELINE,
+	    (capacity + CIX_DHEAP_PAD) * sizeof *nodes) != 0) {
+		return NULL;
+	}
+
+	return nodes + CIX_DHEAP_PAD;
+}
+
+static void
+cix_dheap_link(struct cix_dheap *heap, size_t start)
+{
+	size_t i;
+
+	for (i = start; i < heap->capacity; ++i) {
+		heap->slots[i].item = NULL;
+		heap->slots[i].position = i + 1 < heap->capacity ? i + 1 :
+		    CIX_DHEAP_NONE;
+	}
+
+	heap->free_slot = start < heap->capacity ? start : CIX_DHEAP_NONE;
+	return;
+}
+
+bool
+cix_dheap_init(struct cix_dheap *heap, size_t size)
+{
+
+	heap->n_elements = 0;
+	heap->capacity = size > 0 ? size : 1;
+	heap->nodes = cix_dheap_nodes(heap->capacity);
+	heap->slots = malloc(heap->capacity * sizeof *heap->slots);
+	if (heap->nodes == NULL || heap->slots == NULL) {
+		cix_dheap_destroy(heap);
+		return false;
+	}
+
+	cix_dheap_link(heap, 0);
+	return true;
+}
+
+void
+cix_dheap_destroy(struct cix_dheap *heap)
+{
+
+	if (heap->nodes != NULL) {
+		free(heap->nodes - CIX_DHEAP_PAD);
+	}
+
+	free(heap->slots);
+	heap->nodes = NULL;
+	heap->slots = NULL;
+	return;
+}
+
+void *
+cix_dheap_peek(const struct cix_dheap *heap)
+{
+
+	return heap->n_elements == 0 ? NULL :
+	    heap->slots[heap->nodes[0].handle].item;
+}
+
+void *
+cix_dheap_item(const struct cix_dheap *heap, cix_dheap_handle_t handle)
+{
+
+	return heap->slots[handle].item;
+}
+
+/*
+ * Make room for one more element.  Every handle is in use whenever the
+ * heap is full, so the new handles become the whole free list.
+ */
+static bool
+cix_dheap_reserve(struct cix_dheap *heap)
+{
+	struct cix_dheap_node *nodes;
+	struct cix_dheap_slot *slots;
+	size_t capacity = heap->capacity << 1;
+
+	if (heap->n_elements < heap->capacity) {
+		return true;
+	}
+
+	if (capacity > (size_t)UINT32_MAX + 1) {
+		return false;
+	}
+
+	nodes = cix_dheap_nodes(capacity);
+	if (nodes == NULL) {
+		return false;
+	}
+
+	slots = realloc(heap->slots, capacity * sizeof *slots);
+	if (slots == NULL) {
+		free(nodes - CIX_DHEAP_PAD);
+		return false;
+	}
+
+	memcpy(nodes, heap->nodes, heap->n_elements * sizeof *nodes);
+	free(heap->nodes - CIX_DHEAP_PAD);
+
+	heap->nodes = nodes;
+	heap->slots = slots;
+	heap->capacity = capacity;
+	cix_dheap_link(heap, heap->n_elements);
+	return true;
+}
+
+static inline void
+cix_dheap_place(struct cix_dheap *heap, size_t position,
+    struct cix_dheap_node node)
+{
+
+	heap->nodes[position] = node;
+	heap->slots[node.handle].position = position;
+	return;
+}
+
+#define CIX_DHEAP_MIN_BEFORE(X, Y)	((X) < (Y))
+#define CIX_DHEAP_MAX_BEFORE(X, Y)	((X) > (Y))
+
+/*
+ * Generate the functions for one ordering.  BEFORE(X, Y) is true if a node
+ * with score X belongs above a node with score Y.
+ */
+#define CIX_DHEAP_GENERATE(ORDER, BEFORE)				\
+static void								\
+cix_dheap_##ORDER##_up(struct cix_dheap *heap, size_t cursor)		\
+{									\
+	struct cix_dheap_node node = heap->nodes[cursor];		\
+									\
+	while (cursor > 0) {						\
+		size_t parent = CIX_DHEAP_PARENT(cursor);		\
+									\
+		if (BEFORE(node.score, heap->nodes[parent].score) ==	\
+		    false)						\
+			break;						\
+									\
+		cix_dheap_place(heap, cursor, heap->nodes[parent]);	\
+		cursor = parent;					\
+	}								\
+									\
+	cix_dheap_place(heap, cursor, node);				\
+	return;								\
+}									\
+									\
+static void								\
+cix_dheap_##ORDER##_down(struct cix_dheap *heap, size_t cursor)		\
+{									\
+	struct cix_dheap_node node = heap->nodes[cursor];		\
+									\
+	for (;;) {							\
+		size_t child = CIX_DHEAP_CHILD(cursor);			\
+		size_t end = child + CIX_DHEAP_ARITY;			\
+		size_t best = child;					\
+									\
+		if (child >= heap->n_elements)				\
+			break;						\
+									\
+		if (end > heap->n_elements)				\
+			end = heap->n_elements;				\
+									\
+		for (++child; child < end; ++child) {			\
+			if (BEFORE(heap->nodes[child].score,		\
+			    heap->nodes[best].score)) {			\
+				best = child;				\
+			}						\
+		}							\
+									\
+		if (BEFORE(heap->nodes[best].score, node.score) ==	\
+		    false)						\
+			break;						\
+									\
+		cix_dheap_place(heap, cursor, heap->nodes[best]);	\
+		cursor = best;						\
+	}								\
+									\
+	cix_dheap_place(heap, cursor, node);				\
+	return;								\
+}									\
+									\
+bool									\
+cix_dheap_##ORDER##_push(struct cix_dheap *heap, void *item,		\
+    cix_heap_score_t score, cix_dheap_handle_t *handle)			\
+{									\
+	struct cix_dheap_slot *slot;					\
+	size_t cursor;							\
+									\
+	if (cix_dheap_reserve(heap) == false)				\
+		return false;						\
+									\
+	cursor = heap->n_elements++;					\
+	slot = &heap->slots[heap->free_slot];				\
+	heap->nodes[cursor].score = score;				\
+	heap->nodes[cursor].handle = heap->free_slot;			\
+	heap->free_slot = slot->position;				\
+	slot->item = item;						\
+									\
+	if (handle != NULL)						\
+		*handle = heap->nodes[cursor].handle;			\
+									\
+	cix_dheap_##ORDER##_up(heap, cursor);				\
+	return true;							\
+}									\
+									\
+void *									\
+cix_dheap_##ORDER##_remove(struct cix_dheap *heap,			\
+    cix_dheap_handle_t handle)						\
+{									\
+	struct cix_dheap_slot *slot = &heap->slots[handle];		\
+	size_t position = slot->position;				\
+	void *item = slot->item;					\
+									\
+	if (position != --heap->n_elements) {				\
+		struct cix_dheap_node last =				\
+		    heap->nodes[heap->n_elements];			\
+									\
+		cix_dheap_place(heap, position, last);			\
+		if (position > 0 && BEFORE(last.score,			\
+		    heap->nodes[CIX_DHEAP_PARENT(position)].score)) {	\
+			cix_dheap_##ORDER##_up(heap, position);		\
+		} else {						\
+			cix_dheap_##ORDER##_down(heap, position);	\
+		}							\
+	}								\
+									\
+	slot->item = NULL;						\
+	slot->position = heap->free_slot;				\
+	heap->free_slot = handle;					\
+	return item;							\
+}									\
+									\
+void *									\
+cix_dheap_##ORDER##_pop(struct cix_dheap *heap)				\
+{									\
+									\
+	if (heap->n_elements == 0)					\
+		return NULL;						\
+									\
+	return cix_dheap_##ORDER##_remove(heap, heap->nodes[0].handle);	\
+}									\
+									\
+void									\
+cix_dheap_##ORDER##_update(struct cix_dheap *heap,			\
+    cix_dheap_handle_t handle, cix_heap_score_t score)			\
+{									\
+	size_t position = heap->slots[handle].position;			\
+	cix_heap_score_t old = heap->nodes[position].score;		\
+									\
+	heap->nodes[position].score = score;				\
+	if (BEFORE(score, old)) {					\
+		cix_dheap_##ORDER##_up(heap, position);			\
+	} else {							\
+		cix_dheap_##ORDER##_down(heap, position);		\
+	}								\
+									\
+	return;								\
+}
+
+CIX_DHEAP_GENERATE(min, CIX_DHEAP_MIN_BEFORE)
+CIX_DHEAP_GENERATE(max, CIX_DHEAP_MAX_BEFORE)
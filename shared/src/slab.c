@@ -0,0 +1,154 @@
+#include <ck_md.h>
+#include <ck_pr.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+/*
+ * Each chunk starts with a header padded out to a full cache line so that
+ * the objects that follow it remain cache-line aligned.
+ */
+struct cix_slab_chunk {
+	struct cix_slab_chunk *next;
+};
+
+#define CIX_SLAB_HEADER_SIZE	CK_MD_CACHELINE
+#define CIX_SLAB_ALIGN		(sizeof(void *))
+
+static bool
+cix_slab_grow(struct cix_slab *slab)
+{
+	struct cix_slab_chunk *chunk;
+	unsigned char *objects;
+	size_t chunk_size;
+	unsigned int i;
+
+	chunk_size = CIX_SLAB_HEADER_SIZE +
+	    slab->object_size * slab->chunk_objects;
+	if (posix_memalign((void **)&chunk, CK_MD_CACHELINE, chunk_size) !=
+	    0) {
+		fprintf(stderr, "failed to allocate slab chunk\n");
+		return false;
+	}
+
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+
+	/*
+	 * Push objects in reverse so that allocations are handed out in
+	 * address order.
+	 */
+	objects = (unsigned char *)chunk + CIX_SLAB_HEADER_SIZE;
+	for (i = slab->chunk_objects; i-- > 0;) {
+		struct cix_slab_object *object =
+		    (struct cix_slab_object *)(objects + i * slab->object_size);
+
+		object->next = slab->free_list;
+		slab->free_list = object;
+	}
+
+	ck_pr_store_64(&slab->stats.chunks, slab->stats.chunks + 1);
+	ck_pr_store_64(&slab->stats.capacity,
+	    slab->stats.capacity + slab->chunk_objects);
+	return true;
+}
+
+bool
+cix_slab_init(struct cix_slab *slab, size_t object_size,
+    unsigned int chunk_objects, unsigned int n_chunk)
+{
+	unsigned int i;
+
+	if (object_size < sizeof(struct cix_slab_object)) {
+		object_size = sizeof(struct cix_slab_object);
+	}
+
+	slab->object_size = (object_size + CIX_SLAB_ALIGN - 1) &
+	    ~(CIX_SLAB_ALIGN - 1);
+	slab->chunk_objects = chunk_objects;
+	slab->free_list = NULL;
+	slab->chunks = NULL;
+
+	slab->stats.chunks = 0;
+	slab->stats.capacity = 0;
+	slab->stats.in_use = 0;
+	slab->stats.high_water = 0;
+	slab->stats.allocations = 0;
+
+	for (i = 0; i < n_chunk; ++i) {
+		if (cix_slab_grow(slab) == false) {
+			cix_slab_destroy(slab);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void
+cix_slab_destroy(struct cix_slab *slab)
+{
+	struct cix_slab_chunk *chunk, *next;
+
+	for (chunk = slab->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	slab->chunks = NULL;
+	slab->free_list = NULL;
+	return;
+}
+
+void *
+cix_slab_alloc(struct cix_slab *slab)
+{
+	struct cix_slab_object *object;
+	uint64_t in_use;
+
+	if (slab->free_list == NULL && cix_slab_grow(slab) == false) {
+		return NULL;
+	}
+
+	object = slab->free_list;
+	slab->free_list = object->next;
+
+	in_use = slab->stats.in_use + 1;
+	ck_pr_store_64(&slab->stats.in_use, in_use);
+	ck_pr_store_64(&slab->stats.allocations, slab->stats.allocations + 1);
+	if (in_use > slab->stats.high_water) {
+		ck_pr_store_64(&slab->stats.high_water, in_use);
+	}
+
+	return object;
+}
+
+void
+cix_slab_free(struct cix_slab *slab, void *p)
+{
+	struct cix_slab_object *object = p;
+
+	if (object == NULL) {
+		return;
+	}
+
+	object->next = slab->free_list;
+	slab->free_list = object;
+	ck_pr_store_64(&slab->stats.in_use, slab->stats.in_use - 1);
+	return;
+}
+
+void
+cix_slab_stats(const struct cix_slab *slab, struct cix_slab_stats *stats)
+{
+
+	stats->chunks = ck_pr_load_64(&slab->stats.chunks);
+	stats->capacity = ck_pr_load_64(&slab->stats.capacity);
+	stats->in_use = ck_pr_load_64(&slab->stats.in_use);
+	stats->high_water = ck_pr_load_64(&slab->stats.high_water);
+	stats->allocations = ck_pr_load_64(&slab->stats.allocations);
+	return;
+}
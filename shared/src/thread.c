@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "thread.h"
+
+bool
+cix_thread_create(pthread_t *tid, int cpu, cix_thread_start_t start,
+    void *closure)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int r;
+
+	if (cpu == CIX_THREAD_CPU_ANY) {
+		r = pthread_create(tid, NULL, start, closure);
+		if (r != 0) {
+			fprintf(stderr, "failed to create thread: %s\n",
+			    strerror(r));
+			return false;
+		}
+
+		return true;
+	}
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		fprintf(stderr, "invalid cpu %d\n", cpu);
+		return false;
+	}
+
+	r = pthread_attr_init(&attr);
+	if (r != 0) {
+		fprintf(stderr, "failed to initialize thread attributes: %s\n",
+		    strerror(r));
+		return false;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	r = pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+	if (r == 0) {
+		r = pthread_create(tid, &attr, start, closure);
+	}
+
+	pthread_attr_destroy(&attr);
+	if (r != 0) {
+		fprintf(stderr, "failed to create thread on cpu %d: %s\n", cpu,
+		    strerror(r));
+		return false;
+	}
+
+	return true;
+}
+
+bool
+cix_thread_call(int cpu, cix_thread_start_t start, void *closure,
+    void **result)
+{
+	pthread_t tid;
+	int r;
+
+	if (cix_thread_create(&tid, cpu, start, closure) == false) {
+		return false;
+	}
+
+	r = pthread_join(tid, result);
+	if (r != 0) {
+		fprintf(stderr, "failed to join thread: %s\n", strerror(r));
+		return false;
+	}
+
+	return true;
+}
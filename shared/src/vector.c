@@ -31,12 +31,13 @@ cix_vector_grow(struct cix_vector **v)
 		return true;
 	}
 
-	new_length = vector->length << 1;
+	new_length = vector->length > 0 ? vector->length << 1 : 1;
 	new = realloc(vector, sizeof(*vector) + new_length * vector->item_size);
 
 	if (new == NULL)
 		return false;
 
+	new->capacity = new_length;
 	*v = new;
 	return true;
 }
@@ -73,6 +74,24 @@ cix_vector_next(struct cix_vector **v)
 	return item;
 }
 
+void *
+cix_vector_insert(struct cix_vector **v, unsigned int index)
+{
+	struct cix_vector *vector;
+	unsigned char *item;
+
+	if (index > (*v)->length || cix_vector_grow(v) == false) {
+		return NULL;
+	}
+
+	vector = *v;
+	item = vector->data + index * vector->item_size;
+	memmove(item + vector->item_size, item,
+	    (vector->length - index) * vector->item_size);
+	++vector->length;
+	return item;
+}
+
 void *
 cix_vector_item(struct cix_vector *vector, unsigned int index)
 {
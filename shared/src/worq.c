@@ -1,44 +1,64 @@
 #include <assert.h>
 #include <ck_pr.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "event.h"
 #include "misc.h"
 #include "worq.h"
 
-#define CIX_WORQ_CACHE_LINE_MASK (CK_MD_CACHELINE - 1)
+static inline struct cix_worq_item *
+cix_worq_slot(struct cix_worq *worq, uint64_t index)
+{
 
-struct cix_worq_item {
-	unsigned int ready;
-	unsigned char data[];
-};
+	return cix_worq_ring_slot(worq, index, worq->slot_size, worq->size);
+}
 
 bool
-cix_worq_init(struct cix_worq *worq, size_t item_size, unsigned int length)
+cix_worq_init(struct cix_worq *worq, size_t item_size, unsigned int length,
+    unsigned long flags)
 {
-	size_t overage;
+	unsigned int i;
 
 	assert((length & (length - 1)) == 0);
 
-	worq->slot_size = item_size + sizeof(struct cix_worq_item);
-	overage = worq->slot_size & CIX_WORQ_CACHE_LINE_MASK;
-	if (overage > 0) {
-		worq->slot_size += CK_MD_CACHELINE - overage;
-	}
+	worq->slot_size = CIX_WORQ_SLOT_SIZE(item_size);
 
-	worq->items = calloc(length, worq->slot_size);
+	worq->items = malloc(length * worq->slot_size);
 	if (worq->items == NULL) {
 		fprintf(stderr, "Failed to allocate queue buffer\n");
 		return false;
 	}
 
+	/*
+	 * Touch the whole ring here rather than leaving it to the first
+	 * producer, so that it is placed on the initializing thread's node.
+	 */
+	memset(worq->items, 0, length * worq->slot_size);
+
 	worq->size = length;
 	worq->mask = worq->size - 1;
+	worq->flags = flags;
 	worq->consume_cursor = 0;
 	worq->produce_cursor = 0;
+	worq->consume_cached = 0;
+	worq->pop_cursor = 0;
 	worq->event = NULL;
+	worq->parked = 1;
+	worq->waiters = 0;
+	worq->space = 0;
+
+	/* Make sure that no slot looks like it holds a completed item. */
+	for (i = 0; i < length; ++i) {
+		cix_worq_slot(worq, i)->sequence = UINT64_MAX;
+	}
 
 	return true;
 }
@@ -52,114 +72,366 @@ cix_worq_destroy(struct cix_worq *worq)
 }
 
 void *
-cix_worq_claim(struct cix_worq *worq)
+cix_worq_claim(struct cix_worq *worq, enum cix_worq_claim_wait wait)
+{
+	void *data;
+
+	if (cix_worq_claim_n(worq, 1, &data, wait) == 0) {
+		return NULL;
+	}
+
+	return data;
+}
+
+static unsigned int
+cix_worq_reserve(struct cix_worq *worq, unsigned int n, void **first)
 {
-	struct cix_worq_item *slot;
 	uint64_t index;
 
-	for (;;) {
-		uint64_t end = ck_pr_load_64(&worq->consume_cursor);
+	n = cix_worq_ring_reserve(worq, n, worq->size, &index);
+	if (n > 0) {
+		*first = cix_worq_slot(worq, index)->data;
+	}
+
+	return n;
+}
 
-		index = ck_pr_load_64(&worq->produce_cursor);
+/*
+ * Announce the producer as a waiter before the last attempt, so that the
+ * consumer either makes room before that attempt or sees the waiter
+ * after it and bumps the futex word.  Reading the word first means that
+ * a wakeup in between is never lost.
+ */
+static unsigned int
+cix_worq_claim_sleep(struct cix_worq *worq, unsigned int n, void **first)
+{
+	unsigned int claimed;
 
-		/* Queue is full */
-		if (index - end >= worq->size) {
-			return NULL;
+	for (;;) {
+		unsigned int space = ck_pr_load_uint(&worq->space);
+
+		ck_pr_inc_uint(&worq->waiters);
+		ck_pr_fence_memory();
+		claimed = cix_worq_reserve(worq, n, first);
+		if (claimed == 0) {
+			(void)syscall(SYS_futex, &worq->space,
+			    FUTEX_WAIT_PRIVATE, space, NULL, NULL, 0);
 		}
 
-		if (ck_pr_cas_64_value(&worq->produce_cursor, index,
-		    index + 1, &index) == true) {
-			break;
+		ck_pr_dec_uint(&worq->waiters);
+		if (claimed > 0) {
+			return claimed;
 		}
 	}
+}
 
-	index &= worq->mask;
-	slot = (struct cix_worq_item *)(worq->items + index * worq->slot_size);
+unsigned int
+cix_worq_claim_n(struct cix_worq *worq, unsigned int n, void **first,
+    enum cix_worq_claim_wait wait)
+{
+	unsigned int claimed, spin;
+
+	claimed = cix_worq_reserve(worq, n, first);
+	if (claimed > 0 || wait == CIX_WORQ_CLAIM_NONBLOCK) {
+		return claimed;
+	}
 
-	return slot->data;
+	for (spin = 0; spin < CIX_WORQ_CLAIM_SPIN; ++spin) {
+		ck_pr_stall();
+		claimed = cix_worq_reserve(worq, n, first);
+		if (claimed > 0) {
+			return claimed;
+		}
+	}
+
+	if (wait == CIX_WORQ_CLAIM_SPIN) {
+		return 0;
+	}
+
+	return cix_worq_claim_sleep(worq, n, first);
 }
 
 void
-cix_worq_publish(struct cix_worq *worq, void *data)
+cix_worq_release(struct cix_worq *worq)
+{
+
+	ck_pr_fence_memory();
+	if (ck_pr_load_uint(&worq->waiters) == 0) {
+		return;
+	}
+
+	ck_pr_inc_uint(&worq->space);
+	(void)syscall(SYS_futex, &worq->space, FUTEX_WAKE_PRIVATE, INT_MAX,
+	    NULL, NULL, 0);
+	return;
+}
+
+static inline struct cix_worq_item *
+cix_worq_item_next(struct cix_worq *worq, struct cix_worq_item *slot)
+{
+
+	return cix_worq_ring_next(worq, slot, worq->slot_size, worq->size);
+}
+
+void *
+cix_worq_next(struct cix_worq *worq, void *data)
+{
+
+	return cix_worq_item_next(worq, cix_worq_item(data))->data;
+}
+
+void
+cix_worq_publish_n(struct cix_worq *worq, void *first, unsigned int n)
+{
+
+	if (n == 0) {
+		return;
+	}
+
+	cix_worq_ring_publish(worq, cix_worq_item(first), n, worq->slot_size,
+	    worq->size);
+	cix_worq_notify(worq);
+	return;
+}
+
+void
+cix_worq_publish_deferred(struct cix_worq *worq, void *data)
 {
-	struct cix_worq_item *slot =
-	    container_of(data, struct cix_worq_item, data);
 
-	(void)worq;
+	cix_worq_ring_publish(worq, cix_worq_item(data), 1, worq->slot_size,
+	    worq->size);
+	return;
+}
+
+void
+cix_worq_notify(struct cix_worq *worq)
+{
 
-	/* Make sure that all producer data was written before publishing. */
-	ck_pr_fence_release();
-	slot->ready = 1;
+	if (worq->event == NULL) {
+		return;
+	}
 
-	if (worq->event != NULL && cix_event_managed_trigger(worq->event) ==
-	    false) {
+	/*
+	 * The items must be visible before the flag is read, or else the
+	 * consumer could check the queue and park between the two.
+	 */
+	ck_pr_fence_memory();
+	if (ck_pr_load_uint(&worq->parked) == 0 ||
+	    ck_pr_fas_uint(&worq->parked, 0) == 0) {
+		return;
+	}
+
+	if (cix_event_managed_trigger(worq->event) == false) {
 		fprintf(stderr, "failed to notify worq consumer\n");
 	}
 
 	return;
 }
 
+void
+cix_worq_publish(struct cix_worq *worq, void *data)
+{
+
+	cix_worq_publish_deferred(worq, data);
+	cix_worq_notify(worq);
+	return;
+}
+
 /*
- * This is not currently thread-safe because the queue is only intended
- * for single-consumer workloads.
+ * Without CIX_WORQ_MULTI_CONSUMER only one thread may pop and complete
+ * items, and it must complete them in the order that they were popped.
+ * Multi-consumer queues may be popped from any number of threads, and
+ * each item is handed to exactly one of them.
  */
 void *
 cix_worq_pop(struct cix_worq *worq, enum cix_worq_wait wait)
 {
-	uint64_t index = worq->consume_cursor;
-	struct cix_worq_item *slot;
+	void *data;
+
+	return cix_worq_pop_n(worq, 1, &data, wait) > 0 ? data : NULL;
+}
+
+void
+cix_worq_complete(struct cix_worq *worq, void *data)
+{
+
+	cix_worq_complete_n(worq, data, 1);
+	return;
+}
+
+/*
+ * Consumers of a multi-consumer queue take a run of published items by
+ * moving the pop cursor past them.  Nothing that they read before then
+ * can change under them: a slot is only reused once the consume cursor
+ * has moved past it, and that cannot happen before it is popped.
+ */
+static unsigned int
+cix_worq_pop_shared(struct cix_worq *worq, unsigned int n, void **first,
+    enum cix_worq_wait wait)
+{
+	struct cix_worq_item *item;
+	uint64_t available, index;
+	unsigned int count, i;
 
-	/* Wait for a producer to add a new item to the queue. */
 	for (;;) {
-		uint64_t last = ck_pr_load_64(&worq->produce_cursor);
+		index = ck_pr_load_64(&worq->pop_cursor);
+		available = ck_pr_load_64(&worq->produce_cursor) - index;
+		if (available == 0) {
+			if (wait != CIX_WORQ_WAIT_BLOCK) {
+				return 0;
+			}
+
+			ck_pr_stall();
+			continue;
+		}
 
-		/* XXX: Deal with overflow */
-		if (index < last) {
-			break;
+		if (available > n) {
+			available = n;
+		}
+
+		item = cix_worq_slot(worq, index);
+		for (count = 0; count < available; ++count) {
+			if (ck_pr_load_uint(&item->ready) == 0) {
+				break;
+			}
+
+			item = cix_worq_item_next(worq, item);
 		}
 
-		if (wait != CIX_WORQ_WAIT_BLOCK) {
-			return NULL;
+		if (count == 0) {
+			if (wait == CIX_WORQ_WAIT_NONBLOCK) {
+				return 0;
+			}
+
+			ck_pr_stall();
+			continue;
 		}
+
+		if (ck_pr_cas_64(&worq->pop_cursor, index, index + count) ==
+		    true) {
+			break;
+		}
+	}
+
+	ck_pr_fence_acquire();
+	item = cix_worq_slot(worq, index);
+	*first = item->data;
+	ck_pr_fence_store();
+	for (i = 0; i < count; ++i) {
+		ck_pr_store_64(&item->sequence, index + i);
+		item = cix_worq_item_next(worq, item);
 	}
 
-	/* Wait for producer to publish new item */
-	index &= worq->mask;
-	slot = (struct cix_worq_item *)(worq->items + index * worq->slot_size);
+	return count;
+}
+
+/*
+ * Move the consume cursor past every item that has been completed in
+ * order.  Whoever completes the oldest outstanding item does this, so
+ * every completion checks after marking its own items.  A slot holds a
+ * completed item for a given position if its sequence matches and it is
+ * no longer ready.
+ */
+static void
+cix_worq_advance(struct cix_worq *worq)
+{
+	uint64_t index = ck_pr_load_64(&worq->consume_cursor);
 
 	for (;;) {
-		unsigned int ready = ck_pr_load_uint(&slot->ready);
+		struct cix_worq_item *slot = cix_worq_slot(worq, index);
 
-		if (ready != 0) {
-			ck_pr_fence_acquire();
-			return slot->data;
+		if (ck_pr_load_64(&slot->sequence) != index) {
+			return;
 		}
 
-		if (wait == CIX_WORQ_WAIT_NONBLOCK) {
-			return NULL;
+		/* The sequence must be read before the ready flag. */
+		ck_pr_fence_load();
+		if (ck_pr_load_uint(&slot->ready) != 0) {
+			return;
+		}
+
+		if (ck_pr_cas_64_value(&worq->consume_cursor, index,
+		    index + 1, &index) == true) {
+			++index;
 		}
 	}
+}
+
+/*
+ * Only the first slot is waited for.  Later ones that are still being
+ * written are left for the next call.
+ */
+unsigned int
+cix_worq_pop_n(struct cix_worq *worq, unsigned int n, void **first,
+    enum cix_worq_wait wait)
+{
+	unsigned int count;
+
+	if (worq->flags & CIX_WORQ_MULTI_CONSUMER) {
+		return cix_worq_pop_shared(worq, n, first, wait);
+	}
+
+	for (;;) {
+		count = cix_worq_ring_ready(worq, n, worq->slot_size,
+		    worq->size);
+		if (count > 0) {
+			*first = cix_worq_slot(worq,
+			    worq->consume_cursor)->data;
+			return count;
+		}
 
-	return NULL;
+		if (wait == CIX_WORQ_WAIT_NONBLOCK) {
+			return 0;
+		}
+
+		/* Only wait for a slot that has already been claimed. */
+		if (wait == CIX_WORQ_WAIT_BLOCK_SLOT &&
+		    ck_pr_load_64(&worq->produce_cursor) ==
+		    worq->consume_cursor) {
+			return 0;
+		}
+
+		ck_pr_stall();
+	}
 }
 
 void
-cix_worq_complete(struct cix_worq *worq, void *data)
+cix_worq_complete_n(struct cix_worq *worq, void *first, unsigned int n)
 {
-	struct cix_worq_item *slot =
-	    container_of(data, struct cix_worq_item, data);
-
-	slot->ready = 0;
+	struct cix_worq_item *slot = cix_worq_item(first);
+	unsigned int i;
+
+	if (worq->flags & CIX_WORQ_MULTI_CONSUMER) {
+		/*
+		 * Everything done with the items has to be visible before
+		 * another consumer can hand their slots back to producers,
+		 * and the marks before this consumer looks for the oldest
+		 * item.
+		 */
+		ck_pr_fence_release();
+		for (i = 0; i < n; ++i) {
+			ck_pr_store_uint(&slot->ready, 0);
+			slot = cix_worq_item_next(worq, slot);
+		}
 
-	/*
-	 * If we change to support multiple consumer threads then we will
-	 * need a store fence here.
-	 */
+		ck_pr_fence_memory();
+		cix_worq_advance(worq);
+		cix_worq_release(worq);
+		return;
+	}
 
-	++worq->consume_cursor;
+	cix_worq_ring_complete(worq, slot, n, worq->slot_size, worq->size);
 	return;
 }
 
+unsigned int
+cix_worq_length(struct cix_worq *worq)
+{
+	uint64_t consume = ck_pr_load_64(&worq->consume_cursor);
+
+	return ck_pr_load_64(&worq->produce_cursor) - consume;
+}
+
 bool
 cix_worq_event_subscribe(struct cix_worq *worq, struct cix_event *event)
 {
@@ -172,3 +444,31 @@ cix_worq_event_subscribe(struct cix_worq *worq, struct cix_event *event)
 	worq->event = event;
 	return true;
 }
+
+bool
+cix_worq_park(struct cix_worq *worq)
+{
+	uint64_t popped;
+
+	ck_pr_store_uint(&worq->parked, 1);
+	ck_pr_fence_memory();
+
+	/* Items that other consumers are processing do not count. */
+	popped = worq->flags & CIX_WORQ_MULTI_CONSUMER ?
+	    ck_pr_load_64(&worq->pop_cursor) :
+	    ck_pr_load_64(&worq->consume_cursor);
+	if (ck_pr_load_64(&worq->produce_cursor) != popped) {
+		ck_pr_store_uint(&worq->parked, 0);
+		return false;
+	}
+
+	return true;
+}
+
+void
+cix_worq_unpark(struct cix_worq *worq)
+{
+
+	ck_pr_store_uint(&worq->parked, 0);
+	return;
+}